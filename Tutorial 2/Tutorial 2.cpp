@@ -1,193 +1,1014 @@
-/*A combination of atomic functions, parallel scan, and map functions are used to equalise the input images using parallel programming and functions.
-
-The first function, which looks to compute the initial intensity histogram using the input image and output intensity histogram as parameters, 
-assumes the bins are initialised at zero, sets the current bin index to the pixel value of each pixel in the input image, and then uses the 
-'atomic_inc' function to add this pixel to the intensity histogram.
-
-Instead of using the atomic add function for the second function, an inclusive scan function written by Hillis-Steele was used. 
-To create a double-buffered variant of this inclusive scan, this function takes the intensity histogram, the output cumulative histogram, and two local buffers.
-
-Because the cumulative histogram isn't scaled to 8-bit images when it's computed, 
-the function 'norm_hist' is used to scale and normalise the cumulative histogram to 0-255 for 8-bit images. 
-The normalisation is carried out by dividing each element/pixel in the cumulative histogram by the result of the image size (total number of pixels) 
-divided by the bin size (256).
-
-The cumulative histogram is now utilised as a look-up table for mapping the original image intensities onto the equalised output image, 
-as it has been scaled for 8-bit images. The 'back project' function attempts to accomplish this by taking as parameters the original image, the output image, 
-and the normalised cumulative histogram. The function here aims to use the original image pixel intensities as an index to the look-up table, 
-assigning that new intensity value to each output pixel.
-
-The user is eventually presented with a new image, as well as information on memory transfer, kernel execution time, and total program execution time.*/
-
-#include <iostream>
-#include <vector>
-#include "Utils.h"
-#include "CImg.h"
-
-using namespace cimg_library;
-
-void print_help() {
-	std::cerr << "Application usage:" << std::endl;
-
-	std::cerr << "  -p : select platform " << std::endl;
-	std::cerr << "  -d : select device" << std::endl;
-	std::cerr << "  -l : list all platforms and devices" << std::endl;
-	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
-	std::cerr << "  -h : print this message" << std::endl;
-}
-
-int main(int argc, char** argv) {
-	//Part 1 - handle command line options such as device selection, verbosity, etc.
-	int platform_id = 0;
-	int device_id = 0;
-	string image_filename = "test.pgm";
-
-	for (int i = 1; i < argc; i++) {
-		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
-		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
-		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
-		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
-		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
-	} 
-
-	cimg::exception_mode(0);
-
-	//detect any potential exceptions
-	try {
-		int bin_count;
-		std::cout << "Enter number of bins - 256 for 8-bit image" << std::endl;
-		cin >> bin_count;
-		CImg<unsigned char> image_input(image_filename.c_str());
-		CImgDisplay disp_input(image_input, "input");
-		const int image_size = image_input.size();
-
-		std::vector<int> H(bin_count); //number of bins (length of buffer B)
-
-		size_t local_size = H.size(); //local size set to number of bins
-		
-		//Part 3 - host operations
-		//3.1 Select computing devices
-		cl::Context context = GetContext(platform_id, device_id);
-
-		//display the selected device
-		std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
-
-		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
-
-		//3.2 Load & build the device code
-		cl::Program::Sources sources;
-
-		AddSources(sources, "kernels/my_kernels.cl");
-
-		cl::Program program(context, sources);
-
-		//build and debug the kernel code
-		try {
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
-		std::vector<int> int_histogram_buffer(H.size());
-		size_t int_hist_size = int_histogram_buffer.size() * sizeof(int);
-		//Part 4 - device operations
-
-		//device - buffers
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, image_input.size()); //should be the same as input image
-		cl::Buffer int_histogram(context, CL_MEM_READ_WRITE, int_hist_size * sizeof(int));
-		cl::Buffer cum_histogram(context, CL_MEM_READ_WRITE, int_hist_size * sizeof(int));
-		cl::Buffer norm_histogram(context, CL_MEM_READ_WRITE, int_hist_size * sizeof(int));
-
-		cl::Event event;
-		cl::Event eventB;
-		cl::Event eventC;
-		cl::Event eventD;
-
-		//4.1 Copy images to device memory
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0], NULL, &event);
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0], NULL, &eventB);
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0], NULL, &eventC);
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0], NULL, &eventD);
-
-
-		//4.2 Setup and execute the kernel (i.e. device code)
-		cl::Kernel kernel = cl::Kernel(program, "int_hist");
-		kernel.setArg(0, dev_image_input);
-		kernel.setArg(1, int_histogram);
-
-		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(image_input.size()), cl::NDRange(local_size), NULL, &event);
-		//4.3 Copy the result from device to host
-		queue.enqueueReadBuffer(int_histogram, CL_TRUE, 0, int_hist_size, &int_histogram_buffer.data()[0]);
-
-		//std::cout << "Int_Histogram = " << int_histogram_buffer << std::endl;
-
-		std::vector<int> cum_histogram_buffer(H.size());
-		size_t cum_hist_size = cum_histogram_buffer.size() * sizeof(int);
-
-		cl::Kernel kernel_cum = cl::Kernel(program, "cum_hist");
-		kernel_cum.setArg(0, int_histogram);
-		kernel_cum.setArg(1, cum_histogram);
-		kernel_cum.setArg(2, cl::Local(local_size * sizeof(size_t)));//local memory size - arguments for kernel function!!
-		kernel_cum.setArg(3, cl::Local(local_size * sizeof(size_t)));//local memory size - arguments for kernel function!! - for scan_add second buffer
-
-		queue.enqueueNDRangeKernel(kernel_cum, cl::NullRange, cl::NDRange(cum_hist_size), cl::NDRange(local_size), NULL, &event);
-		queue.enqueueReadBuffer(cum_histogram, CL_TRUE, 0, cum_hist_size, &cum_histogram_buffer[0]);
-
-		//std::cout << "Cumulative_Histogram = " << cum_histogram_buffer << std::endl;
-
-		std::vector<int> norm_histogram_buffer(H.size());
-		size_t norm_hist_size = norm_histogram_buffer.size() * sizeof(int);
-
-		cl::Kernel kernel_norm = cl::Kernel(program, "norm_hist");
-		kernel_norm.setArg(0, cum_histogram);
-		kernel_norm.setArg(1, norm_histogram);
-		kernel_norm.setArg(2, int(image_input.size()));
-		kernel_norm.setArg(3, int(H.size()));
-
-		queue.enqueueNDRangeKernel(kernel_norm, cl::NullRange, cl::NDRange(norm_hist_size), cl::NDRange(local_size), NULL, &event);
-		queue.enqueueReadBuffer(norm_histogram, CL_TRUE, 0, norm_hist_size, &norm_histogram_buffer[0]);
-
-		//std::cout << "Norm_Histogram = " << norm_histogram_buffer << std::endl;
-
-		vector<unsigned char> output_buffer(image_input.size());
-
-		cl::Kernel kernel_output = cl::Kernel(program, "back_project");
-		kernel_output.setArg(0, dev_image_input);
-		kernel_output.setArg(1, norm_histogram);
-		kernel_output.setArg(2, dev_image_output);
-
-		queue.enqueueNDRangeKernel(kernel_output, cl::NullRange, cl::NDRange(image_input.size()), cl::NDRange(local_size), NULL, &event);
-		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output_buffer.size(), &output_buffer.data()[0]);
-
-		CImg<unsigned char> output_image(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
-		
-		std::cout << "Kernel execution time [ns]:" << event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << "Memory transfer:" << (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>() +
-			event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>() + event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()
-			+ event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) << std::endl;
-
-		std::cout << GetFullProfilingInfo(event, ProfilingResolution::PROF_US) << std::endl;
-
-		CImgDisplay disp_output(output_image, "output");
-
-		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-			disp_input.wait(1);
-			disp_output.wait(1);
-		}
-	}
-
-	catch (const cl::Error& err) {
-		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
-	}
-	catch (CImgException& err) {
-		std::cerr << "ERROR: " << err.what() << std::endl;
-	}
-
-	return 0;
-}
+/*A combination of atomic functions, parallel scan, and map functions are used to equalise the input images using parallel programming and functions.
+
+The first function, which looks to compute the initial intensity histogram using the input image and output intensity histogram as parameters, 
+assumes the bins are initialised at zero, sets the current bin index to the pixel value of each pixel in the input image, and then uses the 
+'atomic_inc' function to add this pixel to the intensity histogram. 'int_hist_local' ('-hist local') privatises the histogram per work group 
+instead, counting with local atomics and merging into the global histogram with a single 'atomic_add' per bin.
+
+Instead of using the atomic add function for the second function, an inclusive scan function written by Hillis-Steele was used. 
+To create a double-buffered variant of this inclusive scan, this function takes the intensity histogram, the output cumulative histogram, and two local buffers.
+A single work group can only scan as many bins as the device work group size allows, so larger bin counts are scanned hierarchically: 
+'cum_hist_block' scans each block of bins in local memory and stores the block totals, the totals are scanned in turn (recursively, if needed), 
+and 'cum_hist_add' adds the total of all preceding blocks back onto each bin. '-scan blelloch' selects the work-efficient Blelloch scan instead.
+
+Because the cumulative histogram isn't scaled to 8-bit images when it's computed, 
+the function 'norm_hist' is used to scale and normalise the cumulative histogram to 0-255 for 8-bit images. 
+The normalisation is carried out by dividing each element/pixel in the cumulative histogram by the result of the image size (total number of pixels) 
+divided by the bin size (256). '-norm cdf' uses 'norm_hist_cdf' instead, the standard (cdf - cdf_min) * (L - 1) / (N - cdf_min).
+
+The cumulative histogram is now utilised as a look-up table for mapping the original image intensities onto the equalised output image, 
+as it has been scaled for 8-bit images. The 'back project' function attempts to accomplish this by taking as parameters the original image, the output image, 
+and the normalised cumulative histogram. The function here aims to use the original image pixel intensities as an index to the look-up table, 
+assigning that new intensity value to each output pixel.
+
+The pipeline itself lives in the 'Equaliser' class (Equalisation.h), which creates the queue, builds the program and allocates the device buffers once. 
+The other modes - batch, tuning, multi-device, streaming, sequence, CPU backend, engine and sharded - are described in their own headers and in print_help.
+
+The user is eventually presented with a new image, as well as a per-stage profile of memory transfers, kernel execution times, and total execution time.*/
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+#include "Tuning.h"
+#include "MultiDevice.h"
+#include "Streaming.h"
+#include "Sequence.h"
+#include "CpuEqualiser.h"
+#include "Engine.h"
+#include "Instrumentation.h"
+#include "Sharding.h"
+
+using namespace cimg_library;
+
+//lists the files of a batch - either the files of a directory with one of the given extensions or the lines of a list file
+vector<string> ListBatchFiles(const string& batch_input, const vector<string>& extensions) {
+	vector<string> image_filenames;
+
+	if (cimg::is_directory(batch_input.c_str())) {
+		CImgList<char> filenames = cimg::files(batch_input.c_str(), false, 0, true);
+		for (unsigned int i = 0; i < filenames.size(); i++) {
+			string filename = filenames[i].data();
+			string extension = cimg::split_filename(filename.c_str());
+			for (size_t j = 0; j < extensions.size(); j++) {
+				if (cimg::strcasecmp(extension.c_str(), extensions[j].c_str()) == 0) {
+					image_filenames.push_back(filename);
+					break;
+				}
+			}
+		}
+	}
+	else {
+		ifstream list_file(batch_input);
+		if (!list_file)
+			throw CImgIOException("Cannot open batch list '%s'", batch_input.c_str());
+		string filename;
+		while (getline(list_file, filename)) {
+			if (!filename.empty() && (filename.back() == '\r')) //list files written on Windows
+				filename.pop_back();
+			if (!filename.empty())
+				image_filenames.push_back(filename);
+		}
+	}
+
+	return image_filenames;
+}
+
+//lists the images of a batch - either the .pgm/.ppm files of a directory or the lines of a list file
+vector<string> ListBatchImages(const string& batch_input) {
+	return ListBatchFiles(batch_input, vector<string>({ "pgm", "ppm" }));
+}
+
+//bit depth of an image file - 16 for PNM files (P2/P3/P5/P6) whose maximum value is above 255, otherwise 8
+int ImageBitDepth(const string& filename) {
+	ifstream file(filename.c_str(), ios::binary);
+	string magic;
+	file >> magic;
+	if ((magic != "P2") && (magic != "P3") && (magic != "P5") && (magic != "P6"))
+		return 8;
+
+	int values[3]; //width, height and maximum value, possibly separated by comment lines
+	for (int i = 0; (i < 3) && file; ) {
+		file >> ws;
+		if (file.peek() == '#') {
+			string comment;
+			getline(file, comment);
+		}
+		else if (file >> values[i])
+			i++;
+	}
+
+	return (file && (values[2] > 255)) ? 16 : 8;
+}
+
+//equalises every image of a batch with one equaliser and saves the results to output_dir as equalised_<name>
+//images are streamed through the equaliser's slots: while the device works on one image the host loads the next one and saves the previous one
+//images that fail to load or save are reported and skipped, returns the number of failed images
+template <typename T>
+int RunBatch(BasicEqualiser<T>& equaliser, const vector<string>& image_filenames, const string& output_dir) {
+	vector<string> slot_filenames(equaliser.SlotCount()); //output file of the image in flight in each slot, empty if the slot is free
+	int failed = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < image_filenames.size() + equaliser.SlotCount(); i++) {
+		int slot = (int)(i % equaliser.SlotCount());
+
+		//the slot's previous image is saved before the slot is reused - the last SlotCount() iterations only drain the slots
+		if (!slot_filenames[slot].empty()) {
+			try {
+				equaliser.Collect(slot).save(slot_filenames[slot].c_str());
+			}
+			catch (CImgException& err) {
+				std::cerr << "ERROR: " << slot_filenames[slot] << ": " << err.what() << std::endl;
+				failed++;
+			}
+			slot_filenames[slot].clear();
+		}
+
+		if (i >= image_filenames.size())
+			continue;
+
+		try {
+			equaliser.SlotInput(slot).load(image_filenames[i].c_str()); //the slot's host image is reused, so host memory only grows with the images
+		}
+		catch (CImgException& err) {
+			std::cerr << "ERROR: " << image_filenames[i] << ": " << err.what() << std::endl;
+			failed++;
+			continue;
+		}
+		equaliser.Submit(slot);
+		slot_filenames[slot] = output_dir + "/equalised_" + cimg::basename(image_filenames[i].c_str());
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Equalised " << image_filenames.size() - failed << " of " << image_filenames.size() << " images in " << seconds << " s";
+	if (!image_filenames.empty())
+		std::cout << " (" << 1000.0 * seconds / image_filenames.size() << " ms per image)";
+	std::cout << std::endl;
+
+	return failed;
+}
+
+//pass 1 of the sharded mode - adds every image of the worker's shard to its partial histogram and saves that to partial_filename
+//images that fail to load are reported and skipped, returns the number of failed images
+int RunShardHistogram(ShardWorker& worker, const vector<string>& image_filenames, const string& partial_filename) {
+	CImg<unsigned char> image;
+	int failed = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < image_filenames.size(); i++) {
+		try {
+			if (ImageBitDepth(image_filenames[i]) == 16)
+				throw CImgArgumentException("The sharded mode only supports 8-bit images");
+			image.load(image_filenames[i].c_str());
+			worker.AddImage(image);
+		}
+		catch (CImgException& err) {
+			std::cerr << "ERROR: " << image_filenames[i] << ": " << err.what() << std::endl;
+			failed++;
+		}
+	}
+	SavePartialHistogram(partial_filename, worker.Partial());
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Counted " << worker.Partial().image_count << " of " << image_filenames.size() << " images (" << worker.Partial().pixel_count
+		<< " pixels) in " << seconds << " s - saved " << partial_filename << std::endl;
+	return failed;
+}
+
+//pass 2 of the sharded mode - maps every image of the worker's shard with the dataset look-up table and saves it to output_dir
+//returns the number of failed images
+int RunShardApply(ShardWorker& worker, const vector<string>& image_filenames, const string& output_dir) {
+	CImg<unsigned char> image, output_image;
+	int failed = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < image_filenames.size(); i++) {
+		try {
+			if (ImageBitDepth(image_filenames[i]) == 16)
+				throw CImgArgumentException("The sharded mode only supports 8-bit images");
+			image.load(image_filenames[i].c_str());
+			worker.Apply(image, output_image);
+			output_image.save((output_dir + "/equalised_" + cimg::basename(image_filenames[i].c_str())).c_str());
+		}
+		catch (CImgException& err) {
+			std::cerr << "ERROR: " << image_filenames[i] << ": " << err.what() << std::endl;
+			failed++;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Equalised " << image_filenames.size() - failed << " of " << image_filenames.size() << " images in " << seconds << " s" << std::endl;
+	return failed;
+}
+
+//value below which the given fraction of the sorted samples fall (nearest rank)
+double Percentile(const vector<double>& sorted_samples, double fraction) {
+	if (sorted_samples.empty())
+		return 0.0;
+	size_t rank = (size_t)ceil(fraction * sorted_samples.size());
+	return sorted_samples[(rank > 0) ? rank - 1 : 0];
+}
+
+//prints min/median/p95/p99 of the samples, which are sorted in place
+void PrintStatistics(const string& name, vector<double>& samples) {
+	sort(samples.begin(), samples.end());
+	std::cout << "  " << left << setw(26) << name << right << setw(12) << samples.front() << setw(12) << Percentile(samples, 0.5)
+		<< setw(12) << Percentile(samples, 0.95) << setw(12) << Percentile(samples, 0.99) << std::endl;
+}
+
+//equalises the frames in order with the histogram and look-up table kept between frames, and saves each to output_dir
+//returns the number of frames that failed
+int RunSequence(SequenceEqualiser& equaliser, const vector<string>& frame_filenames, const string& output_dir) {
+	CImg<unsigned char> frame, output_image;
+	vector<double> times;
+	int failed = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < frame_filenames.size(); i++) {
+		try {
+			frame.load(frame_filenames[i].c_str());
+			equaliser.Equalise(frame, output_image);
+			output_image.save((output_dir + "/equalised_" + cimg::basename(frame_filenames[i].c_str())).c_str());
+		}
+		catch (CImgException& err) {
+			std::cerr << "ERROR: " << frame_filenames[i] << ": " << err.what() << std::endl;
+			failed++;
+			continue;
+		}
+		times.push_back(DeviceTime(equaliser.Profile()));
+		std::cout << cimg::basename(frame_filenames[i].c_str()) << ": " << equaliser.ChangedBands() << " changed bands, " << times.back() << " us" << std::endl;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Equalised " << frame_filenames.size() - failed << " of " << frame_filenames.size() << " frames in " << seconds << " s" << std::endl;
+	if (!times.empty()) {
+		std::cout << "  " << left << setw(26) << "Device time [us]" << right << setw(12) << "Min" << setw(12) << "Median" << setw(12) << "p95" << setw(12) << "p99" << std::endl;
+		PrintStatistics("per frame", times);
+	}
+	std::cout << "Peak resident memory: " << PeakResidentMemory() / (1024 * 1024) << " MB" << std::endl;
+
+	return failed;
+}
+
+//low contrast, slightly noisy synthetic test image - the same for every run so that devices and variants see the same data
+CImg<unsigned char> SyntheticImage(int width, int height) {
+	CImg<unsigned char> image(width, height, 1, 1);
+	cimg_ulong rng = 0x5eed;
+	cimg_forXY(image, x, y)
+		image(x, y) = (unsigned char)(64 + (64 * (x + y)) / (width + height) + (int)cimg::rand(16, &rng));
+	return image;
+}
+
+//equalises each image warmups times untimed and then iterations times, and reports per-stage device times and end-to-end
+//host times (min/median/p95/p99 in us) and the throughput at the median end-to-end time
+//loads the sample images (from images/ or the working directory) and makes the synthetic ones of the given sizes (1920x1080 and 3840x2160 if none)
+//returns false if a synthetic size is invalid
+bool LoadBenchmarkImages(vector<string> synthetic_sizes, vector<CImg<unsigned char> >& images, vector<string>& names) {
+	const char* sample_images[] = { "test.pgm", "test_large.pgm" };
+	for (int i = 0; i < 2; i++) {
+		string filename = string("images/") + sample_images[i];
+		if (!ifstream(filename.c_str()).good())
+			filename = sample_images[i];
+		if (!ifstream(filename.c_str()).good()) {
+			std::cerr << "WARNING: " << sample_images[i] << " not found, skipped" << std::endl;
+			continue;
+		}
+		images.push_back(CImg<unsigned char>(filename.c_str()));
+		names.push_back(filename);
+	}
+
+	if (synthetic_sizes.empty()) {
+		synthetic_sizes.push_back("1920x1080");
+		synthetic_sizes.push_back("3840x2160");
+	}
+	for (size_t i = 0; i < synthetic_sizes.size(); i++) {
+		int width = 0, height = 0;
+		if ((sscanf(synthetic_sizes[i].c_str(), "%dx%d", &width, &height) != 2) || (width <= 0) || (height <= 0)) {
+			std::cerr << "ERROR: invalid synthetic image size '" << synthetic_sizes[i] << "'" << std::endl;
+			return false;
+		}
+		images.push_back(SyntheticImage(width, height));
+		names.push_back("synthetic");
+	}
+
+	return true;
+}
+
+//stages enqueued more than once per image (e.g. the blocks of the hierarchical scan) are summed per iteration
+void RunBenchmark(Equaliser& equaliser, const vector<CImg<unsigned char> >& images, const vector<string>& image_names, int warmups, int iterations) {
+	CImg<unsigned char> output_image;
+
+	for (size_t i = 0; i < images.size(); i++) {
+		const CImg<unsigned char>& image = images[i];
+
+		for (int j = 0; j < warmups; j++)
+			equaliser.Equalise(image, output_image);
+
+		vector<string> stage_names;
+		vector<vector<double> > stage_samples;
+		vector<double> host_samples;
+
+		for (int j = 0; j < iterations; j++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			equaliser.Equalise(image, output_image);
+			host_samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+
+			const vector<ProfiledEvent>& profile = equaliser.Profile();
+			vector<double> stage_times(stage_names.size(), 0.0);
+			for (size_t k = 0; k < profile.size(); k++) {
+				size_t stage = find(stage_names.begin(), stage_names.end(), profile[k].name) - stage_names.begin();
+				if (stage == stage_names.size()) {
+					stage_names.push_back(profile[k].name);
+					stage_samples.push_back(vector<double>());
+					stage_times.push_back(0.0);
+				}
+				stage_times[stage] += (profile[k].event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile[k].event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / 1000.0;
+			}
+			for (size_t k = 0; k < stage_names.size(); k++)
+				stage_samples[k].push_back(stage_times[k]);
+		}
+
+		std::cout << image_names[i] << " (" << image.width() << "x" << image.height() << ", " << warmups << " warmups, " << iterations << " iterations)" << std::endl;
+		std::cout << "  " << left << setw(26) << "Stage [us]" << right << setw(12) << "Min" << setw(12) << "Median" << setw(12) << "p95" << setw(12) << "p99" << std::endl;
+		for (size_t k = 0; k < stage_names.size(); k++)
+			PrintStatistics(stage_names[k], stage_samples[k]);
+		PrintStatistics("end-to-end (host)", host_samples);
+		std::cout << "  Throughput: " << image.size() / Percentile(host_samples, 0.5) << " MP/s" << std::endl; //pixels per us is megapixels per s
+		std::cout << "  Peak resident memory: " << PeakResidentMemory() / (1024 * 1024) << " MB" << std::endl;
+	}
+}
+
+//the same benchmark on the CPU backend, with the host time of each stage
+void RunCpuBenchmark(CpuEqualiser& equaliser, const vector<CImg<unsigned char> >& images, const vector<string>& image_names, int warmups, int iterations) {
+	CImg<unsigned char> output_image;
+
+	for (size_t i = 0; i < images.size(); i++) {
+		const CImg<unsigned char>& image = images[i];
+
+		for (int j = 0; j < warmups; j++)
+			equaliser.Equalise(image, output_image);
+
+		vector<vector<double> > stage_samples(equaliser.StageTimes().size());
+		vector<double> host_samples;
+
+		for (int j = 0; j < iterations; j++) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			equaliser.Equalise(image, output_image);
+			host_samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+			for (size_t k = 0; k < stage_samples.size(); k++)
+				stage_samples[k].push_back(equaliser.StageTimes()[k]);
+		}
+
+		std::cout << image_names[i] << " (" << image.width() << "x" << image.height() << ", " << warmups << " warmups, " << iterations << " iterations)" << std::endl;
+		std::cout << "  " << left << setw(26) << "Stage [us]" << right << setw(12) << "Min" << setw(12) << "Median" << setw(12) << "p95" << setw(12) << "p99" << std::endl;
+		for (size_t k = 0; k < stage_samples.size(); k++)
+			PrintStatistics(CpuEqualiser::StageName((int)k), stage_samples[k]);
+		PrintStatistics("end-to-end (host)", host_samples);
+		std::cout << "  Throughput: " << image.size() / Percentile(host_samples, 0.5) << " MP/s" << std::endl;
+		std::cout << "  Peak resident memory: " << PeakResidentMemory() / (1024 * 1024) << " MB" << std::endl;
+	}
+}
+
+//equalises image iterations times from each of thread_count host threads at once through one engine and prints the throughput
+void RunEngine(EqualisationEngine& engine, const CImg<unsigned char>& image, int thread_count, int iterations, CImg<unsigned char>& output_image) {
+	output_image.assign(image.width(), image.height(), image.depth(), image.spectrum());
+	engine.Equalise(image.data(), image.width(), image.height() * image.depth(), image.spectrum(), output_image.data()); //warmup, builds the first lane
+
+	vector<std::thread> threads;
+	vector<string> errors(thread_count);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int t = 0; t < thread_count; t++) {
+		threads.push_back(std::thread([&, t]() {
+			CImg<unsigned char> thread_output(image.width(), image.height(), image.depth(), image.spectrum());
+			try {
+				for (int i = 0; i < iterations; i++)
+					engine.Equalise(image.data(), image.width(), image.height() * image.depth(), image.spectrum(), thread_output.data());
+			}
+			catch (const cl::Error& err) {
+				errors[t] = string(err.what()) + ", " + getErrorString(err.err());
+			}
+		}));
+	}
+	for (int t = 0; t < thread_count; t++)
+		threads[t].join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (int t = 0; t < thread_count; t++) {
+		if (!errors[t].empty())
+			std::cerr << "ERROR: thread " << t << ": " << errors[t] << std::endl;
+	}
+	std::cout << thread_count * iterations << " images from " << thread_count << " threads in " << seconds << " s ("
+		<< thread_count * iterations / seconds << " images/s), " << engine.LaneCount() << " lanes, " << engine.BufferCount() << " pooled buffers" << std::endl;
+}
+
+//equalises image image_count times from this thread alone through the engine's asynchronous API, with up to in_flight images started at once
+void RunEngineAsync(EqualisationEngine& engine, const CImg<unsigned char>& image, int in_flight, int image_count, CImg<unsigned char>& output_image) {
+	output_image.assign(image.width(), image.height(), image.depth(), image.spectrum());
+	engine.Equalise(image.data(), image.width(), image.height() * image.depth(), image.spectrum(), output_image.data()); //warmup, builds the first lane
+
+	vector<CImg<unsigned char> > outputs(in_flight, output_image); //one output per image in flight, reused once its future is ready
+	vector<std::future<void> > futures(in_flight);
+	int failed = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < image_count + in_flight; i++) {
+		int slot = i % in_flight;
+		if (futures[slot].valid()) {
+			try {
+				futures[slot].get();
+			}
+			catch (const cl::Error& err) {
+				std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+				failed++;
+			}
+		}
+		if (i < image_count)
+			futures[slot] = engine.EqualiseAsync(image.data(), image.width(), image.height() * image.depth(), image.spectrum(), outputs[slot].data());
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << image_count - failed << " images from one thread, " << in_flight << " in flight, in " << seconds << " s ("
+		<< image_count / seconds << " images/s), " << engine.LaneCount() << " lanes, " << engine.BufferCount() << " pooled buffers" << std::endl;
+}
+
+//displays the input and output images until either window is closed or escape is pressed
+template <typename T>
+void DisplayImages(const CImg<T>& image_input, const CImg<T>& output_image) {
+	CImgDisplay disp_input(image_input, "input");
+	CImgDisplay disp_output(output_image, "output");
+
+	while (!disp_input.is_closed() && !disp_output.is_closed()
+		&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+		disp_input.wait(1);
+		disp_output.wait(1);
+	}
+}
+
+//equalises one image of pixel type T and prints its profile, then saves the output if output_filename is given and displays it unless headless
+//with a trace_filename, the kernel resources and the bandwidth against peak_gbs (measured if 0) are printed and the profile saved as a Chrome trace
+template <typename T>
+void EqualiseImage(const string& image_filename, int platform_id, int device_id, const EqualisationOptions& options, const string& profile_filename,
+	const string& trace_filename, double peak_gbs, const string& output_filename, bool display) {
+	CImg<T> image_input(image_filename.c_str());
+
+	//Part 3 - host operations
+	//3.1 Select computing devices
+	cl::Context context = GetContext(platform_id, device_id);
+
+	//display the selected device
+	std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+
+	//3.2 Create the queue, then load & build the device code
+	BasicEqualiser<T> equaliser(context, options);
+	std::cout << "Program " << (equaliser.ProgramFromCache() ? "loaded from cache" : "built from source") << ", work group size " << equaliser.WorkGroupSize() << std::endl;
+
+	//Part 4 - device operations
+	CImg<T> output_image;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	equaliser.Equalise(image_input, output_image);
+	long long host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	//one row per upload, kernel and readback
+	const vector<ProfiledEvent>& profile = equaliser.Profile();
+	std::cout << GetFullProfilingInfo(profile, ProfilingResolution::PROF_US, host_ns) << std::endl;
+
+	if (!profile_filename.empty()) {
+		bool json = (profile_filename.size() >= 5) && (profile_filename.compare(profile_filename.size() - 5, 5, ".json") == 0);
+		ofstream profile_file(profile_filename.c_str());
+		profile_file << (json ? GetProfilingJSON(profile, host_ns) : GetProfilingCSV(profile, host_ns));
+		if (!profile_file)
+			std::cerr << "ERROR: could not write " << profile_filename << std::endl;
+	}
+
+	if (!trace_filename.empty()) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		if (peak_gbs <= 0.0)
+			peak_gbs = MeasurePeakBandwidth(context);
+		vector<CommandMetrics> metrics = GetCommandMetrics(profile, equaliser.Program(), device, image_input.size());
+		std::cout << GetInstrumentationReport(profile, metrics, peak_gbs) << std::endl;
+
+		ofstream trace_file(trace_filename.c_str());
+		trace_file << GetChromeTrace(profile, metrics, device.getInfo<CL_DEVICE_NAME>(), peak_gbs);
+		if (!trace_file)
+			std::cerr << "ERROR: could not write " << trace_filename << std::endl;
+	}
+
+	//approximate histogram - the look-up table is compared with the one of the exact histogram
+	if (equaliser.SampleCount() > 0)
+		PrintSampledLutError(context, options, image_input, equaliser);
+
+	if (!output_filename.empty())
+		output_image.save(output_filename.c_str());
+	if (display)
+		DisplayImages(image_input, output_image);
+}
+
+//equalises image_input again with the exact histogram and prints how far the sampled look-up table of equaliser is from the exact one
+template <typename T>
+void PrintSampledLutError(const cl::Context& context, const EqualisationOptions& options, const CImg<T>& image_input, BasicEqualiser<T>& equaliser) {
+	EqualisationOptions exact_options = options;
+	exact_options.sample_rate = 1;
+	BasicEqualiser<T> exact_equaliser(context, exact_options);
+	CImg<T> exact_output;
+	exact_equaliser.Equalise(image_input, exact_output);
+
+	vector<int> lut = equaliser.LookUpTable(), exact_lut = exact_equaliser.LookUpTable();
+	int max_error = 0;
+	double total_error = 0.0;
+	for (size_t i = 0; i < lut.size(); i++) {
+		max_error = std::max(max_error, abs(lut[i] - exact_lut[i]));
+		total_error += abs(lut[i] - exact_lut[i]);
+	}
+
+	int sample_count = equaliser.SampleCount();
+	std::cout << "Sampled " << sample_count << " of " << image_input.size() << " pixels (1 in " << options.sample_rate << ")" << std::endl;
+	std::cout << "Look-up table error: max " << max_error << ", mean " << total_error / lut.size() << " levels, bound "
+		<< SampledLutErrorBound(sample_count, options.bin_count) << " levels (99% confidence)" << std::endl;
+}
+
+//equalises one image of pixel type T on the CPU backend and prints the time of each stage, then saves and displays it as EqualiseImage
+template <typename T>
+void EqualiseImageCpu(const string& image_filename, const EqualisationOptions& options, int thread_count, const string& output_filename, bool display) {
+	CImg<T> image_input(image_filename.c_str());
+	BasicCpuEqualiser<T> equaliser(options, thread_count);
+	std::cout << "Runing on the CPU backend, " << equaliser.ThreadCount() << " threads" << std::endl;
+
+	CImg<T> output_image;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	equaliser.Equalise(image_input, output_image);
+	long long host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	for (size_t i = 0; i < equaliser.StageTimes().size(); i++)
+		std::cout << left << setw(14) << BasicCpuEqualiser<T>::StageName((int)i) << right << setw(12) << equaliser.StageTimes()[i] << " us" << std::endl;
+	std::cout << "Host wall-clock [us]: " << host_ns / 1000 << std::endl;
+
+	if (!output_filename.empty())
+		output_image.save(output_filename.c_str());
+	if (display)
+		DisplayImages(image_input, output_image);
+}
+
+//equalises one 8-bit image across every device of every platform and prints the band and profile of each device, then saves and displays it as EqualiseImage
+void EqualiseImageMultiDevice(const string& image_filename, const EqualisationOptions& options, const string& output_filename, bool display) {
+	CImg<unsigned char> image_input(image_filename.c_str());
+
+	MultiDeviceEqualiser equaliser(GetDevices(), options);
+	CImg<unsigned char> output_image;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	equaliser.Equalise(image_input, output_image);
+	long long host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	for (int i = 0; i < equaliser.DeviceCount(); i++) {
+		std::cout << "Device " << i << ", " << equaliser.DeviceName(i) << ": " << equaliser.BandRows(i) << " rows" << std::endl;
+		if (equaliser.BandRows(i) > 0)
+			std::cout << GetFullProfilingInfo(equaliser.Profile(i), ProfilingResolution::PROF_US) << std::endl;
+	}
+	std::cout << "Host wall-clock [us]: " << host_ns / 1000 << std::endl;
+
+	if (!output_filename.empty())
+		output_image.save(output_filename.c_str());
+	if (display)
+		DisplayImages(image_input, output_image);
+}
+
+void print_help() {
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -b : number of bins, instead of asking for it on an interactive single image run - at least 256 (default: 256)" << std::endl;
+	std::cerr << "  -o : save the output image to this file" << std::endl;
+	std::cerr << "  -nodisplay : headless - no image windows, and the number of bins is only taken from -b" << std::endl;
+	std::cerr << "  -hist : histogram kernel - atomic (global atomics) or local (work-group privatised) (default: atomic)" << std::endl;
+	std::cerr << "  -scan : cumulative histogram scan - hs (Hillis-Steele) or blelloch (work-efficient) (default: hs)" << std::endl;
+	std::cerr << "  -resident : upload without blocking and chain every stage through events" << std::endl;
+	std::cerr << "  -norm : look-up table normalisation - scale (cum / (pixels / bins)) or cdf ((cdf - cdf_min) * (L - 1) / (N - cdf_min), not fused) (default: scale)" << std::endl;
+	std::cerr << "  -fuse : resident mode with norm_hist fused into the last scan stage" << std::endl;
+	std::cerr << "  -batch : equalise every .pgm/.ppm file in a directory, or every file listed in a text file, without display - 16-bit files use 65536 bins" << std::endl;
+	std::cerr << "  -outdir : output directory for batch mode (default: .)" << std::endl;
+	std::cerr << "  -slots : number of images in flight in batch mode, each with its own queue and buffers (default: 3)" << std::endl;
+	std::cerr << "  -hostmem : host image memory - pageable, pinned (CL_MEM_ALLOC_HOST_PTR staging) or zerocopy (CL_MEM_USE_HOST_PTR, for integrated GPUs and CPUs) (default: pageable)" << std::endl;
+	std::cerr << "  -wg : work group size of the kernels that run over the image (default: chosen for the device)" << std::endl;
+	std::cerr << "  -ppi : pixels per work item of int_hist and back_project - 1, or a multiple of 16 for the vload16/vstore16 kernels (default: 1)" << std::endl;
+	std::cerr << "  -clahe : contrast limited adaptive equalisation with the given number of tiles, e.g. 8 or 8x6 (default: global equalisation)" << std::endl;
+	std::cerr << "  -clip : CLAHE clip limit as a multiple of the mean bin count of a tile, 0 for no clipping (default: 2)" << std::endl;
+	std::cerr << "  -image : read the input through a cl::Image2D and samplers instead of a buffer, -bench compares both (global flat and adaptive equalisation)" << std::endl;
+	std::cerr << "  -sample : approximate the histogram from one pixel in every N and report the look-up table error against the exact one (default: 1, exact)" << std::endl;
+	std::cerr << "  -colour : RGB images - luma (equalise the YCbCr luminance, keep the chroma) or flat (one histogram over all channels) (default: luma)" << std::endl;
+	std::cerr << "  -nocache : always build the kernels from source instead of using the cached program binary" << std::endl;
+	std::cerr << "  -profile : also write the per-stage profile to a file, as JSON if it ends in .json and CSV otherwise" << std::endl;
+	std::cerr << "  -instrument : print the resources of every kernel and the bandwidth of every stage against the device peak, and save a Chrome trace JSON to this file" << std::endl;
+	std::cerr << "  -peak : peak global memory bandwidth in GB/s for -instrument (default: measured with a device buffer copy)" << std::endl;
+	std::cerr << "  -bench : benchmark the given number of iterations on test.pgm, test_large.pgm and the synthetic images, without display" << std::endl;
+	std::cerr << "  -warmup : untimed runs of each image before the benchmark iterations (default: 3)" << std::endl;
+	std::cerr << "  -synth : add a synthetic benchmark image of the given size, e.g. 4096x4096 (default: 1920x1080 and 3840x2160)" << std::endl;
+	std::cerr << "  -tune : time every work group size, pixels per work item, histogram kernel and scan on the input image and save the fastest for the device" << std::endl;
+	std::cerr << "  -tunefile : tuning profile that -tune writes and every other run reads (default: device_profiles.txt)" << std::endl;
+	std::cerr << "  -multi : split the image into row bands across every device of every platform, sized by each device's throughput" << std::endl;
+	std::cerr << "  -stream : equalise an 8-bit binary PGM of any size in chunks through memory mapped files, writing the result to the given file" << std::endl;
+	std::cerr << "  -chunk : chunk size of the streaming mode in MB (default: 64)" << std::endl;
+	std::cerr << "  -sequence : equalise the frames in a directory or text file in order, keeping the histogram and look-up table between frames" << std::endl;
+	std::cerr << "  -delta : sequence mode - compare each frame with the previous one in this many bands of rows and only update the changed ones (default: 0, every frame counted again)" << std::endl;
+	std::cerr << "  -smooth : sequence mode - weight of the current frame in the moving average of the look-up table, 1 for no smoothing (default: 1)" << std::endl;
+	std::cerr << "  -backend : opencl, or cpu for the multithreaded host implementation of the same pipeline (default: opencl, cpu if the device doesn't exist)" << std::endl;
+	std::cerr << "  -threads : threads of the CPU backend (default: every hardware thread)" << std::endl;
+	std::cerr << "  -engine : equalise the input image from this many host threads at once through one thread-safe engine, -bench times each (default: 20)" << std::endl;
+	std::cerr << "  -async : with -engine, submit every image from one host thread with that many in flight instead of one thread per caller" << std::endl;
+	std::cerr << "  -shard : sharded mode worker - the 8-bit images of this worker's shard, in a directory or text file, with -partial or -lut" << std::endl;
+	std::cerr << "  -partial : pass 1 - count the shard's histograms and save the partial histogram to this file (.hist)" << std::endl;
+	std::cerr << "  -reduce : merge the partial histograms (.hist files of a directory, or a text file listing them) into the dataset look-up table -lut" << std::endl;
+	std::cerr << "  -lut : look-up table file the reducer writes and pass 2 reads, mapping the shard into -outdir" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+int main(int argc, char** argv) {
+	//Part 1 - handle command line options such as device selection, verbosity, etc.
+	int platform_id = 0;
+	int device_id = 0;
+	string image_filename = "test.pgm";
+	string batch_input;
+	string output_dir = ".";
+	int slot_count = 3;
+	string profile_filename;
+	string trace_filename;
+	double peak_gbs = 0.0;
+	int bench_iterations = 0;
+	int bench_warmups = 3;
+	vector<string> synthetic_sizes;
+	bool tune = false;
+	bool multi_device = false;
+	string tuning_filename = "device_profiles.txt";
+	string stream_output;
+	string sequence_input;
+	string output_filename;
+	bool bins_given = false;
+	bool display = true;
+	string backend = "opencl";
+	int thread_count = 0;
+	int engine_threads = 0;
+	bool engine_async = false;
+	int chunk_mb = 64;
+	string shard_input;
+	string partial_filename;
+	string reduce_input;
+	string lut_filename;
+	bool hist_given = false, scan_given = false, wg_given = false, ppi_given = false; //set by hand, so not taken from the tuning profile
+	EqualisationOptions options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { options.bin_count = atoi(argv[++i]); bins_given = true; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+		else if (strcmp(argv[i], "-nodisplay") == 0) { display = false; }
+		else if ((strcmp(argv[i], "-hist") == 0) && (i < (argc - 1))) { options.hist_variant = argv[++i]; hist_given = true; }
+		else if ((strcmp(argv[i], "-scan") == 0) && (i < (argc - 1))) { options.scan_variant = argv[++i]; scan_given = true; }
+		else if (strcmp(argv[i], "-resident") == 0) { options.resident = true; }
+		else if ((strcmp(argv[i], "-norm") == 0) && (i < (argc - 1))) { options.norm_variant = argv[++i]; }
+		else if (strcmp(argv[i], "-fuse") == 0) { options.resident = true; options.fuse_norm = true; }
+		else if ((strcmp(argv[i], "-batch") == 0) && (i < (argc - 1))) { batch_input = argv[++i]; }
+		else if ((strcmp(argv[i], "-outdir") == 0) && (i < (argc - 1))) { output_dir = argv[++i]; }
+		else if ((strcmp(argv[i], "-slots") == 0) && (i < (argc - 1))) { slot_count = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-hostmem") == 0) && (i < (argc - 1))) { options.host_memory = argv[++i]; }
+		else if ((strcmp(argv[i], "-wg") == 0) && (i < (argc - 1))) { options.work_group_size = atoi(argv[++i]); wg_given = true; }
+		else if ((strcmp(argv[i], "-ppi") == 0) && (i < (argc - 1))) { options.pixels_per_item = atoi(argv[++i]); ppi_given = true; }
+		else if ((strcmp(argv[i], "-clahe") == 0) && (i < (argc - 1))) {
+			if (sscanf(argv[++i], "%dx%d", &options.clahe_tiles_x, &options.clahe_tiles_y) < 2) //a single number for square tiling
+				options.clahe_tiles_y = options.clahe_tiles_x;
+		}
+		else if ((strcmp(argv[i], "-clip") == 0) && (i < (argc - 1))) { options.clip_limit = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-colour") == 0) && (i < (argc - 1))) { options.colour_mode = argv[++i]; }
+		else if (strcmp(argv[i], "-image") == 0) { options.use_image = true; }
+		else if ((strcmp(argv[i], "-sample") == 0) && (i < (argc - 1))) { options.sample_rate = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-nocache") == 0) { options.use_program_cache = false; }
+		else if ((strcmp(argv[i], "-profile") == 0) && (i < (argc - 1))) { profile_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-instrument") == 0) && (i < (argc - 1))) { trace_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-peak") == 0) && (i < (argc - 1))) { peak_gbs = atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-bench") == 0) && (i < (argc - 1))) { bench_iterations = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-warmup") == 0) && (i < (argc - 1))) { bench_warmups = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-synth") == 0) && (i < (argc - 1))) { synthetic_sizes.push_back(argv[++i]); }
+		else if (strcmp(argv[i], "-tune") == 0) { tune = true; }
+		else if (strcmp(argv[i], "-multi") == 0) { multi_device = true; }
+		else if ((strcmp(argv[i], "-tunefile") == 0) && (i < (argc - 1))) { tuning_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-stream") == 0) && (i < (argc - 1))) { stream_output = argv[++i]; }
+		else if ((strcmp(argv[i], "-chunk") == 0) && (i < (argc - 1))) { chunk_mb = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-sequence") == 0) && (i < (argc - 1))) { sequence_input = argv[++i]; }
+		else if ((strcmp(argv[i], "-delta") == 0) && (i < (argc - 1))) { options.delta_bands = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-smooth") == 0) && (i < (argc - 1))) { options.lut_smoothing = (float)atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-backend") == 0) && (i < (argc - 1))) { backend = argv[++i]; }
+		else if ((strcmp(argv[i], "-threads") == 0) && (i < (argc - 1))) { thread_count = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-engine") == 0) && (i < (argc - 1))) { engine_threads = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-async") == 0) { engine_async = true; }
+		else if ((strcmp(argv[i], "-shard") == 0) && (i < (argc - 1))) { shard_input = argv[++i]; }
+		else if ((strcmp(argv[i], "-partial") == 0) && (i < (argc - 1))) { partial_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-reduce") == 0) && (i < (argc - 1))) { reduce_input = argv[++i]; }
+		else if ((strcmp(argv[i], "-lut") == 0) && (i < (argc - 1))) { lut_filename = argv[++i]; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+	} 
+
+	if ((options.hist_variant != "atomic") && (options.hist_variant != "local")) {
+		std::cerr << "ERROR: unknown histogram kernel '" << options.hist_variant << "'" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.scan_variant != "hs") && (options.scan_variant != "blelloch")) {
+		std::cerr << "ERROR: unknown scan '" << options.scan_variant << "'" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.norm_variant != "scale") && (options.norm_variant != "cdf")) {
+		std::cerr << "ERROR: unknown normalisation '" << options.norm_variant << "'" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.host_memory != "pageable") && (options.host_memory != "pinned") && (options.host_memory != "zerocopy")) {
+		std::cerr << "ERROR: unknown host memory mode '" << options.host_memory << "'" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.pixels_per_item != 1) && ((options.pixels_per_item <= 0) || (options.pixels_per_item % 16 != 0))) {
+		std::cerr << "ERROR: pixels per work item must be 1 or a multiple of 16" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.clahe_tiles_x < 0) || (options.clahe_tiles_y < 0) || ((options.clahe_tiles_x > 0) != (options.clahe_tiles_y > 0))) {
+		std::cerr << "ERROR: invalid CLAHE tile count" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.colour_mode != "luma") && (options.colour_mode != "flat")) {
+		std::cerr << "ERROR: unknown colour mode '" << options.colour_mode << "'" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if (options.sample_rate < 1) {
+		std::cerr << "ERROR: the sampling rate must be at least 1" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((options.lut_smoothing <= 0.0f) || (options.lut_smoothing > 1.0f) || (options.delta_bands < 0)) {
+		std::cerr << "ERROR: the smoothing weight must be in (0, 1] and the number of delta bands can't be negative" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((backend != "opencl") && (backend != "cpu")) {
+		std::cerr << "ERROR: unknown backend '" << backend << "'" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if (chunk_mb <= 0) {
+		std::cerr << "ERROR: invalid chunk size" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	if ((!shard_input.empty() && (partial_filename.empty() == lut_filename.empty())) || (!reduce_input.empty() && lut_filename.empty())) {
+		std::cerr << "ERROR: -shard needs either -partial (pass 1) or -lut (pass 2), and -reduce needs -lut" << std::endl;
+		print_help();
+		return 1;
+	}
+
+	cimg::exception_mode(0);
+
+	//detect any potential exceptions
+	try {
+		//only the interactive single image run prompts - the headless modes never open a window and default to 256 bins
+		bool headless = tune || !batch_input.empty() || !shard_input.empty() || !reduce_input.empty() || (engine_threads > 0) || (bench_iterations > 0)
+			|| !sequence_input.empty() || !stream_output.empty();
+		if (!bins_given && display && !headless) {
+			std::cout << "Enter number of bins - 256 for 8-bit image, 16-bit images always use 65536" << std::endl;
+			cin >> options.bin_count;
+		}
+		if (options.bin_count < 256) //the histogram kernels index the bins with the pixel values, so every 8-bit value needs a bin
+			throw CImgArgumentException("Invalid number of bins - at least 256 are needed, one for every 8-bit pixel value");
+
+		//reducer of the sharded mode - merges the partial histograms of every worker into the dataset look-up table on the host
+		if (!reduce_input.empty()) {
+			vector<string> partial_filenames = ListBatchFiles(reduce_input, vector<string>({ "hist" }));
+			if (partial_filenames.empty())
+				throw CImgArgumentException("No partial histograms in '%s'", reduce_input.c_str());
+			PartialHistogram total = LoadPartialHistogram(partial_filenames[0]);
+			for (size_t i = 1; i < partial_filenames.size(); i++)
+				AddPartialHistogram(total, LoadPartialHistogram(partial_filenames[i]));
+			SaveLut(lut_filename, DatasetLut(total, options.norm_variant, 255));
+			std::cout << "Merged " << partial_filenames.size() << " partial histograms (" << total.image_count << " images, " << total.pixel_count
+				<< " pixels) - saved " << lut_filename << std::endl;
+			return 0;
+		}
+
+		if ((backend == "opencl") && !DeviceExists(platform_id, device_id)) {
+			std::cerr << "WARNING: there is no OpenCL device " << device_id << " on platform " << platform_id << ", using the CPU backend" << std::endl;
+			backend = "cpu";
+			if (options.colour_mode == "luma") { //the host only equalises colour images as one flat channel
+				std::cerr << "WARNING: the CPU backend equalises colour images as one flat channel (-colour flat)" << std::endl;
+				options.colour_mode = "flat";
+			}
+			if (options.sample_rate > 1) { //and only counts the exact histogram
+				std::cerr << "WARNING: the CPU backend counts every pixel, -sample is ignored" << std::endl;
+				options.sample_rate = 1;
+			}
+		}
+
+		//CPU backend - single images and benchmarks only, the other modes need a device
+		if (backend == "cpu") {
+			if (tune || multi_device || !batch_input.empty() || !sequence_input.empty() || !stream_output.empty() || (engine_threads > 0) || !shard_input.empty())
+				throw CImgArgumentException("The tuning, batch, sequence, streaming, engine, sharded and multi-device modes need an OpenCL device");
+
+			if (bench_iterations > 0) {
+				vector<CImg<unsigned char> > images;
+				vector<string> image_names;
+				if (!LoadBenchmarkImages(synthetic_sizes, images, image_names))
+					return 1;
+				CpuEqualiser equaliser(options, thread_count);
+				std::cout << "Runing on the CPU backend, " << equaliser.ThreadCount() << " threads" << std::endl;
+				RunCpuBenchmark(equaliser, images, image_names, bench_warmups, bench_iterations);
+			}
+			else if (ImageBitDepth(image_filename) == 16) {
+				options.bin_count = std::max(options.bin_count, 65536);
+				EqualiseImageCpu<unsigned short>(image_filename, options, thread_count, output_filename, display);
+			}
+			else {
+				EqualiseImageCpu<unsigned char>(image_filename, options, thread_count, output_filename, display);
+			}
+			return 0;
+		}
+
+		//a 16-bit input image is tuned and equalised with a bin for every value, so its profile is the one tuned for 65536 bins
+		bool single_image = batch_input.empty() && shard_input.empty() && (engine_threads == 0) && (bench_iterations == 0) && sequence_input.empty()
+			&& stream_output.empty() && !multi_device;
+		bool image_16bit = single_image && (ImageBitDepth(image_filename) == 16);
+		if (image_16bit && (options.bin_count < 65536)) {
+			std::cout << "16-bit image - using 65536 bins" << std::endl;
+			options.bin_count = 65536;
+		}
+
+		//tuning mode - sweep the settings on the selected device and save the fastest
+		if (tune) {
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Tuning on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			EqualisationOptions best = image_16bit ? AutoTune(context, options, CImg<unsigned short>(image_filename.c_str()))
+				: AutoTune(context, options, CImg<unsigned char>(image_filename.c_str()));
+			SaveDeviceProfile(tuning_filename, DeviceProfileKey(platform_id, device_id, options.bin_count), best);
+			std::cout << "Fastest: work group size " << best.work_group_size << ", " << best.pixels_per_item << " pixels per work item, "
+				<< best.hist_variant << " histogram, " << best.scan_variant << " scan - saved to " << tuning_filename << std::endl;
+			return 0;
+		}
+
+		//settings tuned for the device and number of bins by an earlier -tune run, unless they were set on the command line
+		auto load_tuned_settings = [&](EqualisationOptions& run_options) {
+			EqualisationOptions tuned = run_options;
+			if (LoadDeviceProfile(tuning_filename, DeviceProfileKey(platform_id, device_id, run_options.bin_count), tuned)) {
+				if (!wg_given) run_options.work_group_size = tuned.work_group_size;
+				if (!ppi_given) run_options.pixels_per_item = tuned.pixels_per_item;
+				if (!hist_given) run_options.hist_variant = tuned.hist_variant;
+				if (!scan_given) run_options.scan_variant = tuned.scan_variant;
+				std::cout << "Using the tuned settings for this device and " << run_options.bin_count << " bins from " << tuning_filename << std::endl;
+			}
+		};
+		EqualisationOptions untuned_options = options; //the 16-bit images of a batch load the settings tuned for their own bins
+		load_tuned_settings(options);
+
+		//batch mode - one context, queue and program for every image, no display
+		if (!batch_input.empty()) {
+			vector<string> image_filenames = ListBatchImages(batch_input);
+			vector<string> filenames_8bit, filenames_16bit; //each bit depth goes through its own equaliser, so that no 16-bit image is truncated
+			for (size_t i = 0; i < image_filenames.size(); i++)
+				((ImageBitDepth(image_filenames[i]) == 16) ? filenames_16bit : filenames_8bit).push_back(image_filenames[i]);
+
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			int failed = 0;
+			if (!filenames_8bit.empty() || filenames_16bit.empty()) {
+				Equaliser equaliser(context, options, slot_count);
+				failed += RunBatch(equaliser, filenames_8bit, output_dir);
+			}
+			if (!filenames_16bit.empty()) {
+				EqualisationOptions options_16bit = untuned_options;
+				options_16bit.bin_count = std::max(options.bin_count, 65536);
+				load_tuned_settings(options_16bit);
+				Equaliser16 equaliser(context, options_16bit, slot_count);
+				failed += RunBatch(equaliser, filenames_16bit, output_dir);
+			}
+			return (failed == 0) ? 0 : 1;
+		}
+
+		//sharded mode worker - pass 1 saves the partial histogram of the shard, pass 2 maps the shard with the reducer's look-up table, no display
+		if (!shard_input.empty()) {
+			vector<string> image_filenames = ListBatchImages(shard_input);
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			if (!partial_filename.empty()) {
+				ShardWorker worker(context, options);
+				return (RunShardHistogram(worker, image_filenames, partial_filename) == 0) ? 0 : 1;
+			}
+			vector<int> lut = LoadLut(lut_filename);
+			options.bin_count = (int)lut.size(); //the workers map with the bins the dataset was counted in
+			ShardWorker worker(context, options);
+			worker.SetLut(lut);
+			return (RunShardApply(worker, image_filenames, output_dir) == 0) ? 0 : 1;
+		}
+
+		//engine mode - concurrent callers of one EqualisationEngine, no display
+		if (engine_threads > 0) {
+			CImg<unsigned char> image_input(image_filename.c_str());
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			EqualisationEngine engine(context, options);
+			CImg<unsigned char> output_image;
+			int iterations = (bench_iterations > 0) ? bench_iterations : 20;
+			if (engine_async)
+				RunEngineAsync(engine, image_input, engine_threads, engine_threads * iterations, output_image);
+			else
+				RunEngine(engine, image_input, engine_threads, iterations, output_image);
+			if (!output_filename.empty())
+				output_image.save(output_filename.c_str());
+			return 0;
+		}
+
+		//benchmark mode - the sample images (from images/ or the working directory) and the synthetic ones, no display
+		if (bench_iterations > 0) {
+			vector<CImg<unsigned char> > images;
+			vector<string> image_names;
+			if (!LoadBenchmarkImages(synthetic_sizes, images, image_names))
+				return 1;
+
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			Equaliser equaliser(context, options);
+			if (options.use_image) { //the buffer path on the same images first, to compare against
+				EqualisationOptions buffer_options = options;
+				buffer_options.use_image = false;
+				Equaliser buffer_equaliser(context, buffer_options);
+				std::cout << "Buffer path:" << std::endl;
+				RunBenchmark(buffer_equaliser, images, image_names, bench_warmups, bench_iterations);
+				std::cout << (equaliser.UsesImages() ? "Image object path:" : "Image object path (not supported, buffers):") << std::endl;
+			}
+			RunBenchmark(equaliser, images, image_names, bench_warmups, bench_iterations);
+			return 0;
+		}
+
+		//sequence mode - frames in order through one persistent histogram and look-up table, no display
+		if (!sequence_input.empty()) {
+			vector<string> frame_filenames = ListBatchImages(sequence_input);
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			SequenceEqualiser equaliser(context, options);
+			return (RunSequence(equaliser, frame_filenames, output_dir) == 0) ? 0 : 1;
+		}
+
+		//streaming mode - the image is never loaded into host memory, so there is no display
+		if (!stream_output.empty()) {
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			vector<ProfiledEvent> profile = StreamEqualise(context, options, image_filename, stream_output, (size_t)chunk_mb << 20);
+			long long host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Device time [us]: " << DeviceTime(profile) << ", host wall-clock [us]: " << host_ns / 1000 << std::endl;
+			std::cout << "Saved " << stream_output << std::endl;
+			return 0;
+		}
+
+		if (multi_device) {
+			if (ImageBitDepth(image_filename) == 16)
+				throw CImgArgumentException("The multi-device mode only supports 8-bit images");
+			EqualiseImageMultiDevice(image_filename, options, output_filename, display);
+		}
+		else if (image_16bit) {
+			EqualiseImage<unsigned short>(image_filename, platform_id, device_id, options, profile_filename, trace_filename, peak_gbs, output_filename, display);
+		}
+		else {
+			EqualiseImage<unsigned char>(image_filename, platform_id, device_id, options, profile_filename, trace_filename, peak_gbs, output_filename, display);
+		}
+	}
+
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1; //scripted runs can tell a failed run from a successful one
+	}
+	catch (CImgException& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
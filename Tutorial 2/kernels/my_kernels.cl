@@ -1,42 +1,522 @@
-kernel void int_hist(global const uchar* A, global int* B) { //takes the input image, and output intensity histogram
-	int id = get_global_id(0); // gets global id - current input value
-	int bin_index = A[id]; //takes the current pixel intensity value as a bin index
-	atomic_inc(&B[bin_index]); //stores each value of the current bin index to the intensity histogram
-}
-
-kernel void cum_hist(__global const int* A, global int* B, local int* scratch_1, local int* scratch_2) { // takes the intensity histogram, output cumulative histogram, and two local size buffers
-	int id = get_global_id(0); // gets global id - current input value
-	int lid = get_local_id(0); //gets local id
-	int N = get_local_size(0); // gets local size
-	local int* scratch_3;//used for buffer swap
-	
-	scratch_1[lid] = A[id]; //cache all N values from global memory to local memory
-
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
-
-	for (int i = 1; i < N; i *= 2) {
-		if (lid >= i)
-			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
-		else
-			scratch_2[lid] = scratch_1[lid];
-
-		barrier(CLK_LOCAL_MEM_FENCE); //clears the scratch bins
-
-		//swaps the buffers
-		scratch_3 = scratch_2;
-		scratch_2 = scratch_1;
-		scratch_1 = scratch_3;
-	}
-	B[id] = scratch_1[lid]; //copy the cache to output array
-}
-
-kernel void norm_hist(global const int* A, global int* B, const int image_size, const int bin_size) { // takes the cumulative histogram, output normalised histogram, image size and bin size
-	int id = get_global_id(0); // gets global id - current input value
-	int scale = image_size / bin_size; //calculates the scale by dividing the image size (total number of pixels) divided by the bin size (256)
-	B[id] = A[id] / scale; // assigns normalised histogram by mapping the result of the cumulative histogram value divided by the scale variable
-}
-
-kernel void back_project(global const uchar* A, global const int* B, global uchar* C) { // takes the original image, normalised histogram and output image
-	int id = get_global_id(0); // gets global id - current input value
-	C[id] = B[A[id]]; // assigns the output image with the value of the original image pixel as the index to the look-up table (normalised cumulative histogram)
-}
\ No newline at end of file
+#ifndef PIXEL_TYPE
+#define PIXEL_TYPE uchar //pixel type of the image kernels - built with -DPIXEL_TYPE=ushort for 16-bit images
+#endif
+
+#define VECTOR_TYPE_(type) type##16
+#define VECTOR_TYPE(type) VECTOR_TYPE_(type)
+#define PIXEL_VECTOR VECTOR_TYPE(PIXEL_TYPE) //16 pixels (uchar16 or ushort16), loaded and stored with vload16/vstore16
+#define PIXEL_MAX ((1 << (8 * sizeof(PIXEL_TYPE))) - 1) //largest value of the pixel type
+
+//the image kernels are launched with the pixel count rounded up to a whole number of work groups, so work items past pixel_count do nothing
+
+kernel void int_hist(global const PIXEL_TYPE* A, global int* B, const int pixel_count) { //takes the input image, output intensity histogram and the number of pixels
+	int id = get_global_id(0); // gets global id - current input value
+	if (id >= pixel_count) //padding work item
+		return;
+	int bin_index = A[id]; //takes the current pixel intensity value as a bin index
+	atomic_inc(&B[bin_index]); //stores each value of the current bin index to the intensity histogram
+}
+
+//approximate histogram - work item i counts a single pixel picked by a hash of i within the i-th block of stride pixels (stratified sampling),
+//so that every part of the image is sampled without the samples following any periodic pattern in it, and the same image always gives the same table
+kernel void int_hist_sampled(global const PIXEL_TYPE* A, global int* B, const int stride, const int sample_count, const int pixel_count) { //takes the input image, output histogram of the samples, pixels per sample, the number of samples and the number of pixels
+	int id = get_global_id(0); // gets global id - current sample
+	if (id >= sample_count) //padding work item
+		return;
+
+	uint hash = (uint)id * 2654435761u; //integer hash of the sample index
+	hash = (hash ^ (hash >> 16)) * 0x45d9f3bu;
+	hash ^= hash >> 16;
+	int index = min(id * stride + (int)(hash % (uint)stride), pixel_count - 1); //the last block may be partial
+	atomic_inc(&B[A[index]]);
+}
+
+kernel void int_hist_vec(global const PIXEL_TYPE* A, global int* B, const int pixel_count) { //takes the input image, output intensity histogram and the number of pixels
+	int id = get_global_id(0); // gets global id
+	int N = get_global_size(0); // gets global size
+	int vector_count = pixel_count / 16; //whole vectors of 16 pixels
+	PIXEL_TYPE pixels[16];
+
+	for (int v = id; v < vector_count; v += N) { //each work item counts every N-th vector, so neighbouring work items read neighbouring vectors
+		vstore16(vload16(v, A), 0, pixels); //one wide load, then the pixels are counted from private memory
+		for (int i = 0; i < 16; i++)
+			atomic_inc(&B[pixels[i]]);
+	}
+
+	for (int i = vector_count * 16 + id; i < pixel_count; i += N) //the last pixel_count % 16 pixels don't fill a vector
+		atomic_inc(&B[A[i]]);
+}
+
+kernel void int_hist_local(global const PIXEL_TYPE* A, global int* B, local int* H, const int bin_size, const int pixel_count) { //takes the input image, output intensity histogram, a local histogram buffer, the bin size and the number of pixels
+	int id = get_global_id(0); // gets global id - current input value
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size
+
+	for (int i = lid; i < bin_size; i += N) //each work item clears a strided share of the local histogram bins
+		H[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE); //wait for the local histogram to be cleared
+
+	if (id < pixel_count) //padding work items still have to reach the barriers
+		atomic_inc(&H[A[id]]); //increments the local bin - contention is limited to the work items of this group
+
+	barrier(CLK_LOCAL_MEM_FENCE); //wait for the whole work group to finish counting
+
+	for (int i = lid; i < bin_size; i += N) { //merges the local histogram into the global one - one atomic per bin per work group
+		if (H[i] != 0)
+			atomic_add(&B[i], H[i]);
+	}
+}
+
+kernel void cum_hist(__global const int* A, global int* B, local int* scratch_1, local int* scratch_2) { // takes the intensity histogram, output cumulative histogram, and two local size buffers
+	int id = get_global_id(0); // gets global id - current input value
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size
+	local int* scratch_3;//used for buffer swap
+	
+	scratch_1[lid] = A[id]; //cache all N values from global memory to local memory
+
+	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+
+	for (int i = 1; i < N; i *= 2) {
+		if (lid >= i)
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+		else
+			scratch_2[lid] = scratch_1[lid];
+
+		barrier(CLK_LOCAL_MEM_FENCE); //clears the scratch bins
+
+		//swaps the buffers
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+	B[id] = scratch_1[lid]; //copy the cache to output array
+}
+
+//double-buffered Hillis-Steele scan of the local size values cached in scratch_1 - returns the buffer that holds the result
+local int* scan_hs(local int* scratch_1, local int* scratch_2) {
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size
+	local int* scratch_3;//used for buffer swap
+
+	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+
+	for (int i = 1; i < N; i *= 2) {
+		if (lid >= i)
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+		else
+			scratch_2[lid] = scratch_1[lid];
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+	return scratch_1;
+}
+
+//maps a cumulative histogram value onto the output intensity range - shared by norm_hist and the fused scan kernels
+int norm_value(int cum_value, int image_size, int bin_size) {
+	int scale = max(image_size / bin_size, 1); //calculates the scale by dividing the image size (total number of pixels) divided by the bin size (256) - at least 1 for images with fewer pixels than bins
+	return min(cum_value / scale, min(bin_size, PIXEL_MAX + 1) - 1); //the rounded down scale can overshoot the last bin (and more bins than pixel values overshoot the pixel type), which would wrap around in the output pixel type
+}
+
+kernel void cum_hist_norm(global const int* A, global int* C, local int* scratch_1, local int* scratch_2, const int image_size, const int bin_size) { // takes the intensity histogram, output normalised histogram, two local size buffers, image size and bin size
+	int id = get_global_id(0); // gets global id - current input value
+	int lid = get_local_id(0); //gets local id
+
+	scratch_1[lid] = A[id]; //cache all N values from global memory to local memory
+
+	local int* scan = scan_hs(scratch_1, scratch_2);
+
+	C[id] = norm_value(scan[lid], image_size, bin_size); //writes the look-up table straight from the scan, skipping norm_hist
+}
+
+kernel void cum_hist_block(global const int* A, global int* B, global int* block_sums, local int* scratch_1, local int* scratch_2, const int bin_size) { // takes the input values, output block-wise cumulative values, output block totals, two local size buffers and the number of values
+	int id = get_global_id(0); // gets global id - current input value
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size
+
+	scratch_1[lid] = (id < bin_size) ? A[id] : 0; //cache the block in local memory - values past the end are padded with zeros
+
+	local int* scan = scan_hs(scratch_1, scratch_2); //same double-buffered Hillis-Steele scan as cum_hist, restricted to one block
+
+	if (id < bin_size)
+		B[id] = scan[lid]; //copy the block scan to output array
+
+	if (lid == N - 1)
+		block_sums[get_group_id(0)] = scan[lid]; //the last work item stores the total of the whole block
+}
+
+//local memory is padded by one element every NUM_BANKS values so that the strided accesses of the Blelloch scan fall into different banks
+#define LOG_NUM_BANKS 5
+#define CONFLICT_FREE_OFFSET(n) ((n) >> LOG_NUM_BANKS)
+
+//Blelloch scan of the block of 2 * local size values starting at block_start - stores the block total and returns the inclusive scan of the two values owned by this work item
+void scan_blelloch(global const int* A, global int* block_sums, local int* scratch, int block_start, int bin_size, int* a_scan, int* b_scan) {
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size - must be a power of two
+	int n = 2 * N; //each work item scans two values
+	int ai = lid; //the work item loads one value from each half of the block
+	int bi = lid + N;
+	int offset = 1;
+
+	int a = (block_start + ai < bin_size) ? A[block_start + ai] : 0; //values past the end are padded with zeros
+	int b = (block_start + bi < bin_size) ? A[block_start + bi] : 0;
+	scratch[ai + CONFLICT_FREE_OFFSET(ai)] = a;
+	scratch[bi + CONFLICT_FREE_OFFSET(bi)] = b;
+
+	for (int d = n >> 1; d > 0; d >>= 1) { //up-sweep - builds partial sums in place up a balanced tree
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			int i = offset * (2 * lid + 1) - 1;
+			int j = offset * (2 * lid + 2) - 1;
+			i += CONFLICT_FREE_OFFSET(i);
+			j += CONFLICT_FREE_OFFSET(j);
+			scratch[j] += scratch[i];
+		}
+		offset *= 2;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid == 0) { //the root holds the block total, which is stored before it is cleared for the down-sweep
+		int last = n - 1 + CONFLICT_FREE_OFFSET(n - 1);
+		block_sums[get_group_id(0)] = scratch[last];
+		scratch[last] = 0;
+	}
+
+	for (int d = 1; d < n; d *= 2) { //down-sweep - distributes the partial sums back down the tree, giving an exclusive scan
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			int i = offset * (2 * lid + 1) - 1;
+			int j = offset * (2 * lid + 2) - 1;
+			i += CONFLICT_FREE_OFFSET(i);
+			j += CONFLICT_FREE_OFFSET(j);
+			int t = scratch[i];
+			scratch[i] = scratch[j];
+			scratch[j] += t;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	*a_scan = scratch[ai + CONFLICT_FREE_OFFSET(ai)] + a; //adding the original values turns the exclusive scan into an inclusive one
+	*b_scan = scratch[bi + CONFLICT_FREE_OFFSET(bi)] + b;
+}
+
+kernel void cum_hist_blelloch(global const int* A, global int* B, global int* block_sums, local int* scratch, const int bin_size) { // takes the input values, output block-wise cumulative values, output block totals, a padded local buffer and the number of values
+	int N = get_local_size(0); // gets local size
+	int a_index = get_group_id(0) * 2 * N + get_local_id(0); //the two values owned by this work item
+	int b_index = a_index + N;
+	int a_scan, b_scan;
+
+	scan_blelloch(A, block_sums, scratch, get_group_id(0) * 2 * N, bin_size, &a_scan, &b_scan);
+
+	if (a_index < bin_size)
+		B[a_index] = a_scan;
+	if (b_index < bin_size)
+		B[b_index] = b_scan;
+}
+
+kernel void cum_hist_blelloch_norm(global const int* A, global int* C, global int* block_sums, local int* scratch, const int image_size, const int bin_size) { // takes the intensity histogram, output normalised histogram, output block total, a padded local buffer, image size and bin size - for a single block
+	int N = get_local_size(0); // gets local size
+	int a_index = get_local_id(0); //the two values owned by this work item
+	int b_index = a_index + N;
+	int a_scan, b_scan;
+
+	scan_blelloch(A, block_sums, scratch, 0, bin_size, &a_scan, &b_scan);
+
+	if (a_index < bin_size) //writes the look-up table straight from the scan, skipping norm_hist
+		C[a_index] = norm_value(a_scan, image_size, bin_size);
+	if (b_index < bin_size)
+		C[b_index] = norm_value(b_scan, image_size, bin_size);
+}
+
+kernel void cum_hist_add(global int* B, global const int* block_sums, const int block_size, const int bin_size) { // takes the block-wise cumulative values, the scanned block totals, the number of values per block and the number of values
+	int id = get_global_id(0); // gets global id - current input value
+	int block = id / block_size; //block that the value was scanned in
+
+	if ((block > 0) && (id < bin_size))
+		B[id] += block_sums[block - 1]; //adds the total of all preceding blocks
+}
+
+kernel void cum_hist_add_norm(global const int* B, global const int* block_sums, global int* C, const int block_size, const int image_size, const int bin_size) { // takes the block-wise cumulative values, the scanned block totals, output normalised histogram, the number of values per block, image size and bin size
+	int id = get_global_id(0); // gets global id - current input value
+	int block = id / block_size; //block that the value was scanned in
+
+	if (id < bin_size)
+		C[id] = norm_value((block > 0) ? B[id] + block_sums[block - 1] : B[id], image_size, bin_size); //completes the scan and writes the look-up table in one pass
+}
+
+kernel void norm_hist(global const int* A, global int* B, const int image_size, const int bin_size) { // takes the cumulative histogram, output normalised histogram, image size and bin size
+	int id = get_global_id(0); // gets global id - current input value
+	B[id] = norm_value(A[id], image_size, bin_size); // assigns normalised histogram by mapping the result of the cumulative histogram value divided by the scale variable
+}
+
+//standard normalisation (cdf - cdf_min) * (L - 1) / (N - cdf_min) - cdf_min is the count of the first non-empty bin, N the last cumulative value
+//and L the output levels (the bins, at most the values of the pixel type); the counts are read as unsigned and the product formed in 64 bits,
+//so gigapixel images neither overflow nor lose precision, and the rounded quotient is clamped to the last output level
+kernel void norm_hist_cdf(global const int* A, global int* B, const int bin_size) { // takes the cumulative histogram, output normalised histogram and bin size
+	int id = get_global_id(0); // gets global id - current input value
+	if (id >= bin_size)
+		return;
+
+	int low = 0, high = bin_size - 1; //the cumulative histogram never decreases, so its first non-zero value is found by binary search
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (A[mid] != 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	ulong cdf_min = (uint)A[low], total = (uint)A[bin_size - 1], cdf = (uint)A[id];
+	ulong last_level = min(bin_size, PIXEL_MAX + 1) - 1;
+
+	if (total == cdf_min) { //a single value, or an empty histogram - there is nothing to spread, so the table leaves the image as it is
+		B[id] = (int)min((ulong)id, last_level);
+		return;
+	}
+	ulong range = total - cdf_min;
+	ulong value = (cdf > cdf_min) ? ((cdf - cdf_min) * last_level + range / 2) / range : 0;
+	B[id] = (int)min(value, last_level);
+}
+
+kernel void back_project(global const PIXEL_TYPE* A, global const int* B, global PIXEL_TYPE* C, const int pixel_count) { // takes the original image, normalised histogram, output image and the number of pixels
+	int id = get_global_id(0); // gets global id - current input value
+	if (id >= pixel_count) //padding work item
+		return;
+	C[id] = B[A[id]]; // assigns the output image with the value of the original image pixel as the index to the look-up table (normalised cumulative histogram)
+}
+
+kernel void back_project_vec(global const PIXEL_TYPE* A, global const int* B, global PIXEL_TYPE* C, const int pixel_count) { // takes the original image, normalised histogram, output image and the number of pixels
+	int id = get_global_id(0); // gets global id
+	int N = get_global_size(0); // gets global size
+	int vector_count = pixel_count / 16; //whole vectors of 16 pixels
+	PIXEL_TYPE pixels[16];
+
+	for (int v = id; v < vector_count; v += N) { //each work item maps every N-th vector
+		vstore16(vload16(v, A), 0, pixels);
+		for (int i = 0; i < 16; i++)
+			pixels[i] = B[pixels[i]]; //looks each pixel up in the look-up table
+		vstore16(vload16(0, pixels), v, C); //one wide store of the mapped vector
+	}
+
+	for (int i = vector_count * 16 + id; i < pixel_count; i += N) //the last pixel_count % 16 pixels don't fill a vector
+		C[i] = B[A[i]];
+}
+
+//colour images - CImg stores the R, G and B planes one after another, so channel c of pixel id is at c * plane_size + id
+//the histogram is built from the full range (JPEG) YCbCr luminance and back-projection replaces only the luminance, keeping the chroma
+float luma(float r, float g, float b) {
+	return 0.299f * r + 0.587f * g + 0.114f * b;
+}
+
+kernel void int_hist_luma(global const PIXEL_TYPE* A, global int* B, const int plane_size, const int bin_size) { //takes the planar RGB input image, output luminance histogram, pixels per plane and bin size
+	int id = get_global_id(0); // gets global id - current pixel
+	if (id >= plane_size) //padding work item
+		return;
+	float y = luma(A[id], A[plane_size + id], A[2 * plane_size + id]); //converts the pixel to luminance on the device
+	atomic_inc(&B[min((int)(y + 0.5f), bin_size - 1)]); //the rounded luminance is the bin index
+}
+
+kernel void back_project_luma(global const PIXEL_TYPE* A, global const int* B, global PIXEL_TYPE* C, const int plane_size, const int bin_size) { // takes the planar RGB image, normalised histogram, output image, pixels per plane and bin size
+	int id = get_global_id(0); // gets global id - current pixel
+	if (id >= plane_size) //padding work item
+		return;
+	float r = A[id], g = A[plane_size + id], b = A[2 * plane_size + id];
+
+	float y = luma(r, g, b);
+	float cb = -0.168736f * r - 0.331264f * g + 0.5f * b; //chroma without the usual offset, it cancels out on the way back
+	float cr = 0.5f * r - 0.418688f * g - 0.081312f * b;
+	float y_eq = B[min((int)(y + 0.5f), bin_size - 1)]; //equalised luminance from the look-up table
+
+	float max_value = min(bin_size, PIXEL_MAX + 1) - 1;
+	C[id] = (PIXEL_TYPE)(clamp(y_eq + 1.402f * cr, 0.0f, max_value) + 0.5f); //converts back to RGB, clamped to the pixel range
+	C[plane_size + id] = (PIXEL_TYPE)(clamp(y_eq - 0.344136f * cb - 0.714136f * cr, 0.0f, max_value) + 0.5f);
+	C[2 * plane_size + id] = (PIXEL_TYPE)(clamp(y_eq + 1.772f * cb, 0.0f, max_value) + 0.5f);
+}
+
+//contrast limited adaptive equalisation (CLAHE) - every plane of the image is split into tiles_x by tiles_y tiles, each tile gets its own histogram
+//and look-up table, and every pixel is mapped by interpolating between the tables of the four tiles whose centres surround it
+//tile t along an axis of size pixels covers [tile_start(t), tile_start(t + 1)), which is exactly the pixels with x * tiles / size == t
+int tile_start(int t, int size, int tiles) {
+	return (t * size + tiles - 1) / tiles;
+}
+
+//number of pixels of a tile, given its index within all the tiles of all the planes
+int tile_pixels(int tile, int width, int height, int tiles_x, int tiles_y) {
+	int tx = tile % tiles_x, ty = (tile / tiles_x) % tiles_y;
+	return (tile_start(tx + 1, width, tiles_x) - tile_start(tx, width, tiles_x)) * (tile_start(ty + 1, height, tiles_y) - tile_start(ty, height, tiles_y));
+}
+
+kernel void tile_hist(global const PIXEL_TYPE* A, global int* B, const int width, const int height, const int tiles_x, const int tiles_y, const int bin_size, const int pixel_count) { //takes the input image, output tile histograms (bin_size each, one after another), plane size, tile counts, bin size and the number of pixels
+	int id = get_global_id(0); // gets global id - current pixel
+	if (id >= pixel_count) //padding work item
+		return;
+
+	int x = id % width, y = (id / width) % height, plane = id / (width * height);
+	int tile = (plane * tiles_y + y * tiles_y / height) * tiles_x + x * tiles_x / width; //every tile of every plane counted in the one launch
+	atomic_inc(&B[tile * bin_size + A[id]]);
+}
+
+kernel void clip_hist(global int* A, local int* scratch, const float clip_limit, const int width, const int height, const int tiles_x, const int tiles_y, const int bin_size) { //takes the tile histograms, a local size buffer, the clip limit (as a multiple of the mean bin count), plane size, tile counts and bin size - one work group per tile
+	int tile = get_group_id(0); //one work group per tile
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size - a power of two
+	global int* H = A + tile * bin_size;
+	int limit = max((int)(clip_limit * tile_pixels(tile, width, height, tiles_x, tiles_y) / bin_size), 1);
+
+	int excess = 0; //counts above the limit, which are clipped off and spread over all the bins
+	for (int i = lid; i < bin_size; i += N)
+		excess += max(H[i] - limit, 0);
+	scratch[lid] = excess;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = N / 2; stride > 0; stride /= 2) { //reduction of the excess of the whole tile
+		if (lid < stride)
+			scratch[lid] += scratch[lid + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	int share = scratch[0] / bin_size, remainder = scratch[0] % bin_size;
+	for (int i = lid; i < bin_size; i += N) //the remainder goes to evenly spaced bins, so the tile's total count is unchanged
+		H[i] = min(H[i], limit) + share + ((((long)i * remainder) % bin_size < remainder) ? 1 : 0);
+}
+
+kernel void tile_lut(global const int* A, global int* C, local int* scratch_1, local int* scratch_2, const int width, const int height, const int tiles_x, const int tiles_y, const int bin_size) { //takes the tile histograms, output tile look-up tables, two local size buffers, plane size, tile counts and bin size - one work group per tile
+	int tile = get_group_id(0); //one work group per tile, so every tile's segment of bins is scanned separately
+	int lid = get_local_id(0); //gets local id
+	int N = get_local_size(0); // gets local size
+	int pixels = tile_pixels(tile, width, height, tiles_x, tiles_y);
+	int carry = 0; //total of the chunks scanned so far
+
+	for (int start = 0; start < bin_size; start += N) { //the tile's bins are scanned a local size chunk at a time
+		int i = start + lid;
+		scratch_1[lid] = (i < bin_size) ? A[tile * bin_size + i] : 0;
+
+		local int* scan = scan_hs(scratch_1, scratch_2);
+
+		if (i < bin_size)
+			C[tile * bin_size + i] = norm_value(carry + scan[lid], pixels, bin_size); //normalised by the pixels of the tile rather than of the image
+		carry += scan[N - 1];
+
+		barrier(CLK_LOCAL_MEM_FENCE); //every work item has read the chunk before the next one is cached
+	}
+}
+
+//the two tiles whose centres surround coordinate x along an axis, and the weight of the second one
+void tile_neighbours(int x, int size, int tiles, int* t0, int* t1, float* weight) {
+	int t = x * tiles / size;
+	float centre = 0.5f * (tile_start(t, size, tiles) + tile_start(t + 1, size, tiles) - 1);
+	*t0 = (x < centre) ? t - 1 : t;
+	*t1 = *t0 + 1;
+
+	if (*t0 < 0) { //before the centre of the first tile
+		*t0 = *t1 = 0;
+		*weight = 0.0f;
+	}
+	else if (*t1 >= tiles) { //past the centre of the last tile
+		*t1 = *t0;
+		*weight = 0.0f;
+	}
+	else {
+		float c0 = 0.5f * (tile_start(*t0, size, tiles) + tile_start(*t0 + 1, size, tiles) - 1);
+		float c1 = 0.5f * (tile_start(*t1, size, tiles) + tile_start(*t1 + 1, size, tiles) - 1);
+		*weight = (x - c0) / (c1 - c0);
+	}
+}
+
+//value of the pixel at x, y of a plane interpolated bilinearly between the look-up tables of the four nearest tiles of that plane
+PIXEL_TYPE clahe_value(global const int* B, int value, int x, int y, int plane, const int width, const int height, const int tiles_x, const int tiles_y, const int bin_size) {
+	int tx0, tx1, ty0, ty1;
+	float ax, ay;
+	tile_neighbours(x, width, tiles_x, &tx0, &tx1, &ax);
+	tile_neighbours(y, height, tiles_y, &ty0, &ty1, &ay);
+
+	global const int* plane_luts = B + plane * tiles_x * tiles_y * bin_size;
+	float top = (1.0f - ax) * plane_luts[(ty0 * tiles_x + tx0) * bin_size + value] + ax * plane_luts[(ty0 * tiles_x + tx1) * bin_size + value];
+	float bottom = (1.0f - ax) * plane_luts[(ty1 * tiles_x + tx0) * bin_size + value] + ax * plane_luts[(ty1 * tiles_x + tx1) * bin_size + value];
+	return (PIXEL_TYPE)((1.0f - ay) * top + ay * bottom + 0.5f); //bilinear interpolation between the four tables
+}
+
+kernel void back_project_clahe(global const PIXEL_TYPE* A, global const int* B, global PIXEL_TYPE* C, const int width, const int height, const int tiles_x, const int tiles_y, const int bin_size, const int pixel_count) { // takes the original image, tile look-up tables, output image, plane size, tile counts, bin size and the number of pixels
+	int id = get_global_id(0); // gets global id - current pixel
+	if (id >= pixel_count) //padding work item
+		return;
+
+	int x = id % width, y = (id / width) % height, plane = id / (width * height);
+	C[id] = clahe_value(B, A[id], x, y, plane, width, height, tiles_x, tiles_y, bin_size);
+}
+
+//sequence mode - the histogram of the previous frame is updated with the pixels that changed instead of being counted again
+kernel void hist_delta(global const PIXEL_TYPE* A, global PIXEL_TYPE* F, global int* H, const int offset, const int pixel_count) { // takes the new pixels, the previous frame (updated in place), the histogram, the first pixel and the number of pixels
+	int id = get_global_id(0); // gets global id - current pixel after offset
+	if (id >= pixel_count) //padding work item
+		return;
+
+	int index = offset + id;
+	PIXEL_TYPE old_value = F[index], new_value = A[index];
+	if (old_value != new_value) { //unchanged pixels don't touch the histogram
+		atomic_dec(&H[old_value]);
+		atomic_inc(&H[new_value]);
+		F[index] = new_value;
+	}
+}
+
+kernel void smooth_lut(global const int* A, global float* S, global int* B, const float alpha) { // takes the look-up table of the current frame, the moving average, the output look-up table and the weight of the current frame
+	int id = get_global_id(0); // gets global id - current bin
+	float average = (alpha >= 1.0f) ? (float)A[id] : mix(S[id], (float)A[id], alpha); //exponential moving average over the frames
+	S[id] = average;
+	B[id] = (int)(average + 0.5f);
+}
+
+//image object path - the input is a read-only 2D image (CL_R with CL_UNORM_INT8, or CL_UNORM_INT16 for 16-bit pixels) with the planes stacked
+//one below another, read through a sampler so that neighbouring work items in both directions hit the same texture cache lines
+//the kernels run over a 2D range rounded up to whole work groups, and write the output to a linear buffer like the buffer path
+#ifdef __IMAGE_SUPPORT__
+constant sampler_t pixel_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+//pixel value at x, y - the normalised channel is scaled back to the integer value that was uploaded
+int read_pixel(read_only image2d_t A, int x, int y) {
+	return (int)(read_imagef(A, pixel_sampler, (int2)(x, y)).x * PIXEL_MAX + 0.5f);
+}
+
+kernel void int_hist_image(read_only image2d_t A, global int* B) { //takes the input image and output intensity histogram
+	int x = get_global_id(0), y = get_global_id(1); // gets global ids - current column and row
+	if ((x >= get_image_width(A)) || (y >= get_image_height(A))) //padding work item
+		return;
+	atomic_inc(&B[read_pixel(A, x, y)]);
+}
+
+kernel void back_project_image(read_only image2d_t A, global const int* B, global PIXEL_TYPE* C) { // takes the original image, normalised histogram and output image
+	int x = get_global_id(0), y = get_global_id(1); // gets global ids - current column and row
+	int width = get_image_width(A);
+	if ((x >= width) || (y >= get_image_height(A))) //padding work item
+		return;
+	C[y * width + x] = B[read_pixel(A, x, y)];
+}
+
+kernel void tile_hist_image(read_only image2d_t A, global int* B, const int height, const int tiles_x, const int tiles_y, const int bin_size) { //takes the input image, output tile histograms, plane height, tile counts and bin size
+	int x = get_global_id(0), row = get_global_id(1); // gets global ids - current column and row of the stacked planes
+	int width = get_image_width(A);
+	if ((x >= width) || (row >= get_image_height(A))) //padding work item
+		return;
+
+	int y = row % height, plane = row / height;
+	int tile = (plane * tiles_y + y * tiles_y / height) * tiles_x + x * tiles_x / width;
+	atomic_inc(&B[tile * bin_size + read_pixel(A, x, row)]);
+}
+
+kernel void back_project_clahe_image(read_only image2d_t A, global const int* B, global PIXEL_TYPE* C, const int height, const int tiles_x, const int tiles_y, const int bin_size) { // takes the original image, tile look-up tables, output image, plane height, tile counts and bin size
+	int x = get_global_id(0), row = get_global_id(1); // gets global ids - current column and row of the stacked planes
+	int width = get_image_width(A);
+	if ((x >= width) || (row >= get_image_height(A))) //padding work item
+		return;
+	C[row * width + x] = clahe_value(B, read_pixel(A, x, row), x, row % height, row / height, width, height, tiles_x, tiles_y, bin_size);
+}
+#endif
\ No newline at end of file
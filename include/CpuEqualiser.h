@@ -0,0 +1,272 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "CImg.h"
+#include "Equalisation.h"
+
+//the AVX2 back projection is compiled into every x86-64 build, without /arch:AVX2, and only run on processors that support it
+#if defined(_M_X64) || defined(__x86_64__)
+#define CPU_EQUALISER_AVX2
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FUNCTION
+#else
+#include <immintrin.h>
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace cimg_library;
+
+//fixed set of worker threads that run the tasks of one call to Run at a time
+class ThreadPool {
+public:
+	//thread_count threads share the work, one of them being the thread that calls Run
+	explicit ThreadPool(int thread_count) : task(NULL), next_task(0), task_count(0), pending(0), stopping(false) {
+		for (int i = 1; i < std::max(thread_count, 1); i++)
+			threads.push_back(std::thread(&ThreadPool::Work, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start_condition.notify_all();
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+	}
+
+	int ThreadCount() const { return (int)threads.size() + 1; }
+
+	//runs run_task(0) to run_task(run_task_count - 1) across the threads and returns once all of them are done
+	void Run(int run_task_count, const std::function<void(int)>& run_task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task = &run_task;
+			next_task = 0;
+			task_count = run_task_count;
+			pending = run_task_count;
+		}
+		start_condition.notify_all();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (next_task < task_count) { //the calling thread takes tasks as well
+			int t = next_task++;
+			lock.unlock();
+			run_task(t);
+			lock.lock();
+			pending--;
+		}
+		done_condition.wait(lock, [this] { return pending == 0; });
+		task = NULL;
+	}
+
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void Work() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			start_condition.wait(lock, [this] { return stopping || (next_task < task_count); });
+			if (stopping)
+				return;
+			int t = next_task++;
+			const std::function<void(int)>* run_task = task;
+			lock.unlock();
+			(*run_task)(t);
+			lock.lock();
+			if (--pending == 0)
+				done_condition.notify_all();
+		}
+	}
+
+	vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	const std::function<void(int)>* task;
+	int next_task;
+	int task_count;
+	int pending; //tasks of the current Run that haven't finished yet
+	bool stopping;
+};
+
+//back_project over pixels [begin, end) - the look-up table holds the int values of the device table, cast to the pixel type as the kernel does
+template <typename T>
+void BackProjectRange(const T* input, const int* lut, T* output, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++)
+		output[i] = (T)lut[input[i]];
+}
+
+#ifdef CPU_EQUALISER_AVX2
+//true if both the processor and the operating system (which has to save the 256-bit registers) support AVX2
+bool CpuSupportsAvx2() {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if (((info[2] & (1 << 27)) == 0) || ((info[2] & (1 << 28)) == 0) || ((_xgetbv(0) & 6) != 6)) //OSXSAVE, AVX and the XMM/YMM state enabled
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+//8-bit back_project with the look-up table read 8 pixels at a time by an AVX2 gather, keeping the low byte of each entry like the scalar cast
+AVX2_FUNCTION void BackProjectRangeAvx2(const unsigned char* input, const int* lut, unsigned char* output, size_t begin, size_t end) {
+	const __m256i low_byte = _mm256_set1_epi32(0xff);
+	const __m256i first_dwords = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0); //the packed bytes of both 128-bit lanes
+	size_t i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(input + i)));
+		__m256i values = _mm256_and_si256(_mm256_i32gather_epi32(lut, indices, 4), low_byte);
+		__m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(values, values), _mm256_setzero_si256());
+		packed = _mm256_permutevar8x32_epi32(packed, first_dwords);
+		_mm_storel_epi64((__m128i*)(output + i), _mm256_castsi256_si128(packed));
+	}
+	for (; i < end; i++) //the last pixels that don't fill a vector
+		output[i] = (unsigned char)lut[input[i]];
+}
+
+//8-bit pixels take the AVX2 gather where the processor has it, the scalar loop otherwise
+template <>
+void BackProjectRange<unsigned char>(const unsigned char* input, const int* lut, unsigned char* output, size_t begin, size_t end) {
+	static const bool avx2 = CpuSupportsAvx2();
+	if (avx2) {
+		BackProjectRangeAvx2(input, lut, output, begin, end);
+		return;
+	}
+	for (size_t i = begin; i < end; i++)
+		output[i] = (unsigned char)lut[input[i]];
+}
+#endif
+
+//host implementation of the same four stages as the OpenCL pipeline - int_hist, cum_hist, norm_hist and back_project - for nodes without a usable
+//OpenCL device and as a baseline for the device speedups; the output is the same as the device output for the same bin count, bit for bit
+//each thread counts its own range of the image into a private histogram and the private histograms are summed bin by bin,
+//the scan and normalisation run on one thread (they only touch the bins), and back projection is split across the threads again,
+//8-bit images through an AVX2 gather on processors that support it
+//colour images are only equalised as one flat channel (the device's '-colour flat') and every pixel is counted - luma, sampled and adaptive
+//equalisation are only available on the device and are refused here rather than giving an output that differs from it
+//options.bin_count must cover every pixel value - 256 for 8-bit and 65536 for 16-bit images
+template <typename T>
+class BasicCpuEqualiser {
+public:
+	//thread_count 0 uses every hardware thread
+	BasicCpuEqualiser(const EqualisationOptions& options, int thread_count = 0) :
+		options(options), pool((thread_count > 0) ? thread_count : std::max((int)std::thread::hardware_concurrency(), 1)),
+		H(options.bin_count), CH(options.bin_count), LUT(options.bin_count), stage_times(4, 0.0) {
+		CheckBinCount<T>(options.bin_count);
+		if (options.clahe_tiles_x > 0)
+			throw CImgArgumentException("Adaptive equalisation is only implemented on the OpenCL backend");
+		if (options.sample_rate > 1)
+			throw CImgArgumentException("Sampled histograms are only implemented on the OpenCL backend");
+		private_histograms.resize(pool.ThreadCount(), vector<int>(options.bin_count));
+	}
+
+	//equalises input into output, which is resized to match the input
+	void Equalise(const CImg<T>& image_input, CImg<T>& output_image) {
+		const size_t pixel_count = image_input.size();
+		if ((image_input.spectrum() == 3) && (options.colour_mode == "luma"))
+			throw CImgArgumentException("Luma equalisation of colour images is only implemented on the OpenCL backend - use '-colour flat'");
+		const T* input = image_input.data();
+		const int thread_count = pool.ThreadCount();
+		output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+		T* output = output_image.data();
+
+		//int_hist - a private histogram per thread, then summed with every thread adding up its own range of bins
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		pool.Run(thread_count, [&](int t) {
+			vector<int>& histogram = private_histograms[t];
+			std::fill(histogram.begin(), histogram.end(), 0);
+			for (size_t i = pixel_count * t / thread_count; i < pixel_count * (t + 1) / thread_count; i++)
+				histogram[input[i]]++;
+		});
+		pool.Run(thread_count, [&](int t) {
+			for (size_t bin = H.size() * t / thread_count; bin < H.size() * (t + 1) / thread_count; bin++) {
+				int sum = 0;
+				for (int k = 0; k < thread_count; k++)
+					sum += private_histograms[k][bin];
+				H[bin] = sum;
+			}
+		});
+		std::chrono::steady_clock::time_point hist_end = std::chrono::steady_clock::now();
+
+		//cum_hist - inclusive scan
+		int sum = 0;
+		for (size_t bin = 0; bin < H.size(); bin++) {
+			sum += H[bin];
+			CH[bin] = sum;
+		}
+		std::chrono::steady_clock::time_point cum_end = std::chrono::steady_clock::now();
+
+		//norm_hist - the same integer arithmetic as norm_value, or norm_hist_cdf, in the kernels
+		const int bin_size = (int)H.size();
+		if (options.norm_variant == "cdf") {
+			vector<int>::const_iterator first = std::find_if(CH.begin(), CH.end(), [](int cum) { return cum != 0; });
+			const unsigned long long cdf_min = (first != CH.end()) ? (unsigned int)*first : 0;
+			const unsigned long long total = (unsigned int)CH.back();
+			const unsigned long long last_level = std::min(bin_size, 1 << (8 * sizeof(T))) - 1;
+			for (size_t bin = 0; bin < H.size(); bin++) {
+				unsigned long long cdf = (unsigned int)CH[bin], value = bin;
+				if (total != cdf_min)
+					value = (cdf > cdf_min) ? ((cdf - cdf_min) * last_level + (total - cdf_min) / 2) / (total - cdf_min) : 0;
+				LUT[bin] = (int)std::min(value, last_level);
+			}
+		}
+		else {
+			const int scale = std::max((int)pixel_count / bin_size, 1);
+			const int last_level = std::min(bin_size, 1 << (8 * sizeof(T))) - 1;
+			for (size_t bin = 0; bin < H.size(); bin++)
+				LUT[bin] = std::min(CH[bin] / scale, last_level);
+		}
+		std::chrono::steady_clock::time_point norm_end = std::chrono::steady_clock::now();
+
+		//back_project
+		pool.Run(thread_count, [&](int t) {
+			BackProjectRange(input, &LUT[0], output, pixel_count * t / thread_count, pixel_count * (t + 1) / thread_count);
+		});
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+		stage_times[0] = std::chrono::duration<double, std::micro>(hist_end - start).count();
+		stage_times[1] = std::chrono::duration<double, std::micro>(cum_end - hist_end).count();
+		stage_times[2] = std::chrono::duration<double, std::micro>(norm_end - cum_end).count();
+		stage_times[3] = std::chrono::duration<double, std::micro>(end - norm_end).count();
+	}
+
+	int ThreadCount() const { return pool.ThreadCount(); }
+
+	//host time of each stage of the last image in us, named by StageName
+	const vector<double>& StageTimes() const { return stage_times; }
+	static const char* StageName(int stage) {
+		const char* names[] = { "int_hist", "cum_hist", "norm_hist", "back_project" };
+		return names[stage];
+	}
+
+	//look-up table of the last image
+	const vector<int>& LookUpTable() const { return LUT; }
+
+private:
+	EqualisationOptions options;
+	ThreadPool pool;
+	vector<vector<int> > private_histograms; //one per thread
+	vector<int> H; //histogram
+	vector<int> CH; //cumulative histogram
+	vector<int> LUT; //normalised cumulative histogram
+	vector<double> stage_times;
+};
+
+typedef BasicCpuEqualiser<unsigned char> CpuEqualiser;
+typedef BasicCpuEqualiser<unsigned short> CpuEqualiser16;
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+
+using namespace cimg_library;
+
+//thread-safe equalisation of 8-bit images for long-running services - the program is built once, and every call borrows a lane (a queue
+//with its own kernels and histogram buffers) and image buffers from pools, so that calls after the first few never pay any setup cost
+//concurrent callers each get a lane of their own and run at the same time, lanes are only created when every existing one is busy
+//EqualiseAsync returns as soon as the image is enqueued, with a future or a callback for its completion (a cl::Event callback on the final read),
+//so that one host thread can keep many images in flight - each keeps its lane until it completes
+//image buffers are pooled in power-of-two size buckets, so images of similar sizes share buffers
+//the histogram kernel (options.hist_variant) and normalisation (options.norm_variant) are those of BasicEqualiser, fused with the scan for "scale"
+//channels are interleaved or planar alike, so they are only equalised as one flat channel - 3-channel images need options.colour_mode "flat",
+//and adaptive and sampled equalisation aren't supported - both are refused rather than giving an output that differs from BasicEqualiser's
+class EqualisationEngine {
+public:
+	EqualisationEngine(const cl::Context& context, const EqualisationOptions& options = EqualisationOptions()) :
+		context(context), options(options), buffer_count(0), in_flight(0) {
+		CheckBinCount<unsigned char>(options.bin_count);
+		if (options.clahe_tiles_x > 0)
+			throw CImgArgumentException("EqualisationEngine doesn't support adaptive equalisation");
+		if (options.sample_rate > 1)
+			throw CImgArgumentException("EqualisationEngine doesn't support sampled histograms");
+		device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+		//a privatised histogram of every bin has to fit in local memory, as in BasicEqualiser
+		if ((this->options.hist_variant == "local") && ((size_t)options.bin_count * sizeof(int) > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())) {
+			std::cerr << "WARNING: " << options.bin_count << " bins do not fit in local memory, using the atomic histogram kernel" << std::endl;
+			this->options.hist_variant = "atomic";
+		}
+
+		program = BuildProgram(context, "kernels/my_kernels.cl", string("-DPIXEL_TYPE=") + PixelType<unsigned char>::Name(), options.use_program_cache);
+		local_size = ImageWorkGroupSize(device, vector<cl::Kernel>({ cl::Kernel(program, HistKernelName()), cl::Kernel(program, "back_project") }), options.work_group_size);
+		scan_local_size = ScanWorkGroupSize(device, program, options.bin_count);
+	}
+
+	~EqualisationEngine() {
+		Wait(); //the callbacks of images still in flight use the pools
+		for (size_t i = 0; i < lanes.size(); i++)
+			delete lanes[i];
+	}
+
+	//equalises the width x height image of channels 8-bit channels at input into out, which must hold as many bytes - safe to call from any thread
+	void Equalise(const uint8_t* input, int width, int height, int channels, uint8_t* out) {
+		EqualiseAsync(input, width, height, channels, out).get();
+	}
+
+	//starts equalising like Equalise and returns straight away - the future is ready, or holds the cl::Error, once out has been written
+	//input and out must stay valid until then
+	std::future<void> EqualiseAsync(const uint8_t* input, int width, int height, int channels, uint8_t* out) {
+		std::shared_ptr<std::promise<void> > promise = std::make_shared<std::promise<void> >();
+		EqualiseAsync(input, width, height, channels, out, [promise](cl_int status) {
+			if (status == CL_COMPLETE)
+				promise->set_value();
+			else
+				promise->set_exception(std::make_exception_ptr(cl::Error(status, "EqualisationEngine::EqualiseAsync")));
+		});
+		return promise->get_future();
+	}
+
+	//starts equalising like Equalise and calls done with CL_COMPLETE, or the error status, once out has been written
+	//done runs on a thread of the OpenCL runtime, so it should hand any long work over to another thread, and mustn't call blocking OpenCL functions
+	void EqualiseAsync(const uint8_t* input, int width, int height, int channels, uint8_t* out, const std::function<void(cl_int)>& done) {
+		const size_t pixel_count = (size_t)width * height * channels;
+		if ((width <= 0) || (height <= 0) || (channels <= 0) || (pixel_count > 0x7fffffff))
+			throw CImgArgumentException("Invalid image size %dx%dx%d", width, height, channels);
+		if ((channels == 3) && (options.colour_mode == "luma"))
+			throw CImgArgumentException("EqualisationEngine only equalises colour images as one flat channel - use colour_mode \"flat\"");
+
+		//the job borrows a lane and buffers until its read completes, so every image in flight has a queue of its own
+		Lane* lane = AcquireLane();
+		Job* job = new Job();
+		job->engine = this;
+		job->lane = lane;
+		job->pixel_count = pixel_count;
+		job->done = done;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			in_flight++;
+		}
+
+		try {
+			job->image_input = AcquireBuffer(pixel_count);
+			job->image_output = AcquireBuffer(pixel_count);
+
+			lane->queue.enqueueFillBuffer(lane->histogram, 0, 0, options.bin_count * sizeof(int));
+			lane->queue.enqueueWriteBuffer(job->image_input, CL_FALSE, 0, pixel_count, input);
+
+			lane->kernel_hist.setArg(0, job->image_input);
+			lane->kernel_hist.setArg(1, lane->histogram);
+			if (options.hist_variant == "local") {
+				lane->kernel_hist.setArg(2, cl::Local((size_t)options.bin_count * sizeof(int)));
+				lane->kernel_hist.setArg(3, options.bin_count);
+				lane->kernel_hist.setArg(4, (int)pixel_count);
+			}
+			else {
+				lane->kernel_hist.setArg(2, (int)pixel_count);
+			}
+			lane->queue.enqueueNDRangeKernel(lane->kernel_hist, cl::NullRange, cl::NDRange(RoundUp(pixel_count, local_size)), cl::NDRange(local_size));
+
+			//the standard normalisation needs the first non-empty bin of the whole scan, so it runs as its own stage
+			const bool cdf_norm = (options.norm_variant == "cdf");
+			EnqueueCumHist(context, lane->queue, program, lane->histogram, lane->cum_histogram, options.bin_count, scan_local_size, options.scan_variant,
+				NULL, NULL, cdf_norm ? NULL : &lane->lut, (int)pixel_count, NULL, &lane->scan_block_sums, 0, &lane->scan_kernels);
+			if (cdf_norm) {
+				lane->kernel_norm.setArg(0, lane->cum_histogram);
+				lane->kernel_norm.setArg(1, lane->lut);
+				lane->kernel_norm.setArg(2, options.bin_count);
+				lane->queue.enqueueNDRangeKernel(lane->kernel_norm, cl::NullRange, cl::NDRange((size_t)options.bin_count), cl::NullRange);
+			}
+
+			lane->kernel_output.setArg(0, job->image_input);
+			lane->kernel_output.setArg(1, lane->lut);
+			lane->kernel_output.setArg(2, job->image_output);
+			lane->kernel_output.setArg(3, (int)pixel_count);
+			lane->queue.enqueueNDRangeKernel(lane->kernel_output, cl::NullRange, cl::NDRange(RoundUp(pixel_count, local_size)), cl::NDRange(local_size));
+
+			cl::Event read_event;
+			lane->queue.enqueueReadBuffer(job->image_output, CL_FALSE, 0, pixel_count, out, NULL, &read_event);
+			lane->queue.flush();
+			read_event.setCallback(CL_COMPLETE, &EqualisationEngine::JobComplete, job); //from here on the callback ends the job
+		}
+		catch (...) { //the lane and buffers go back to the pools either way
+			try { lane->queue.finish(); } catch (const cl::Error&) {}
+			FinishJob(job);
+			throw;
+		}
+	}
+
+	//waits for every image started by EqualiseAsync to finish, including its done callback
+	void Wait() {
+		std::unique_lock<std::mutex> lock(mutex);
+		idle_condition.wait(lock, [this] { return in_flight == 0; });
+	}
+
+	//lanes and pooled image buffers created so far
+	int LaneCount() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return (int)lanes.size();
+	}
+	int BufferCount() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return buffer_count;
+	}
+
+	size_t WorkGroupSize() const { return local_size; }
+
+private:
+	EqualisationEngine(const EqualisationEngine&);
+	EqualisationEngine& operator=(const EqualisationEngine&);
+
+	//queue, kernels and histogram buffers used by one caller at a time - kernel arguments can't be shared between threads
+	struct Lane {
+		cl::CommandQueue queue;
+		cl::Kernel kernel_hist;
+		cl::Kernel kernel_norm; //norm_hist_cdf, the scale normalisation is fused with the scan
+		cl::Kernel kernel_output;
+		cl::Buffer histogram;
+		cl::Buffer cum_histogram;
+		cl::Buffer lut;
+		vector<cl::Buffer> scan_block_sums; //block totals of the hierarchical scans
+		ScanKernels scan_kernels;
+	};
+
+	//an image in flight, from EqualiseAsync to its read completing
+	struct Job {
+		EqualisationEngine* engine;
+		Lane* lane;
+		cl::Buffer image_input;
+		cl::Buffer image_output;
+		size_t pixel_count;
+		std::function<void(cl_int)> done;
+	};
+
+	static void CL_CALLBACK JobComplete(cl_event /*event*/, cl_int status, void* user_data) {
+		Job* job = (Job*)user_data;
+		std::function<void(cl_int)> done = job->done;
+		EqualisationEngine* engine = job->engine;
+
+		engine->ReleaseJob(job);
+		done(status);
+
+		std::lock_guard<std::mutex> lock(engine->mutex);
+		if (--engine->in_flight == 0)
+			engine->idle_condition.notify_all();
+	}
+
+	//returns a job's lane and buffers to the pools and deletes it
+	void ReleaseJob(Job* job) {
+		if (job->image_input() != NULL)
+			ReleaseBuffer(job->image_input, job->pixel_count);
+		if (job->image_output() != NULL)
+			ReleaseBuffer(job->image_output, job->pixel_count);
+		ReleaseLane(job->lane);
+		delete job;
+	}
+
+	//ends a job that failed before its callback was set
+	void FinishJob(Job* job) {
+		ReleaseJob(job);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--in_flight == 0)
+			idle_condition.notify_all();
+	}
+
+	const char* HistKernelName() const { return (options.hist_variant == "local") ? "int_hist_local" : "int_hist"; }
+
+	//size of the bucket a buffer of size bytes comes from - the next power of two, at least 64 KB
+	static size_t BucketSize(size_t size) {
+		size_t bucket = 65536;
+		while (bucket < size)
+			bucket *= 2;
+		return bucket;
+	}
+
+	Lane* AcquireLane() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!free_lanes.empty()) {
+				Lane* lane = free_lanes.back();
+				free_lanes.pop_back();
+				return lane;
+			}
+		}
+
+		//every lane is busy - a new one is set up outside the lock, so that the other callers aren't held up
+		Lane* lane = new Lane();
+		try {
+			lane->queue = cl::CommandQueue(context, device);
+			lane->kernel_hist = cl::Kernel(program, HistKernelName());
+			lane->kernel_norm = cl::Kernel(program, "norm_hist_cdf");
+			lane->kernel_output = cl::Kernel(program, "back_project");
+			lane->histogram = cl::Buffer(context, CL_MEM_READ_WRITE, options.bin_count * sizeof(int));
+			lane->cum_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, options.bin_count * sizeof(int));
+			lane->lut = cl::Buffer(context, CL_MEM_READ_WRITE, options.bin_count * sizeof(int));
+		}
+		catch (...) {
+			delete lane;
+			throw;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		lanes.push_back(lane);
+		return lane;
+	}
+
+	void ReleaseLane(Lane* lane) {
+		std::lock_guard<std::mutex> lock(mutex);
+		free_lanes.push_back(lane);
+	}
+
+	cl::Buffer AcquireBuffer(size_t size) {
+		size_t bucket = BucketSize(size);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			vector<cl::Buffer>& free_buffers = buffers[bucket];
+			if (!free_buffers.empty()) {
+				cl::Buffer buffer = free_buffers.back();
+				free_buffers.pop_back();
+				return buffer;
+			}
+		}
+
+		cl::Buffer buffer(context, CL_MEM_READ_WRITE, bucket);
+		std::lock_guard<std::mutex> lock(mutex);
+		buffer_count++;
+		return buffer;
+	}
+
+	void ReleaseBuffer(const cl::Buffer& buffer, size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers[BucketSize(size)].push_back(buffer);
+	}
+
+	cl::Context context;
+	cl::Device device;
+	cl::Program program;
+	EqualisationOptions options;
+	size_t local_size;
+	size_t scan_local_size;
+
+	std::mutex mutex; //guards the pools below
+	vector<Lane*> lanes; //every lane, owned by the engine
+	vector<Lane*> free_lanes;
+	map<size_t, vector<cl::Buffer> > buffers; //free image buffers by bucket size
+	int buffer_count;
+	int in_flight; //jobs whose callback hasn't finished yet
+	std::condition_variable idle_condition;
+};
@@ -0,0 +1,932 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "Utils.h"
+#include "CImg.h"
+
+using namespace cimg_library;
+
+//settings of the equalisation pipeline, see print_help in Tutorial 2.cpp
+struct EqualisationOptions {
+	int bin_count = 256;
+	string hist_variant = "atomic";
+	string scan_variant = "hs";
+	bool resident = false;
+	bool fuse_norm = false;
+	string norm_variant = "scale"; //norm_hist - scale (cum / (image_size / bin_size)) or cdf ((cdf - cdf_min) * (L - 1) / (N - cdf_min), never fused)
+	bool use_program_cache = true;
+	string host_memory = "pageable"; //pageable, pinned (CL_MEM_ALLOC_HOST_PTR staging) or zerocopy (CL_MEM_USE_HOST_PTR input, mapped output)
+	size_t work_group_size = 0; //work group size of the image kernels, 0 to pick one for the device
+	int pixels_per_item = 1; //1 for the one pixel per work item kernels, a multiple of 16 for the vload16/vstore16 kernels
+	int clahe_tiles_x = 0; //adaptive equalisation with this many tiles across and down each plane, 0 for global equalisation
+	int clahe_tiles_y = 0;
+	float clip_limit = 2.0f; //CLAHE histogram clip limit as a multiple of a tile's mean bin count, 0 for no clipping
+	string colour_mode = "luma"; //RGB images - luma (equalise the YCbCr luminance) or flat (one histogram over all channels)
+	float lut_smoothing = 1.0f; //sequence mode - weight of the current frame in the moving average of the look-up table, 1 for no smoothing
+	int delta_bands = 0; //sequence mode - bands of rows compared with the previous frame so that only changed ones update the histogram, 0 to count every frame again
+	bool use_image = false; //upload the input as a cl::Image2D and read it through a sampler instead of from a buffer
+	int sample_rate = 1; //approximate histogram counting one pixel in every sample_rate, 1 for the exact histogram
+};
+
+//value rounded up to a whole number of multiples
+inline size_t RoundUp(size_t value, size_t multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+//throws if bin_count doesn't give every value of pixel type T a bin of its own - the histogram kernels index the bins with the pixel values unchecked
+template <typename T>
+void CheckBinCount(int bin_count) {
+	if (bin_count < (1 << (8 * sizeof(T))))
+		throw CImgArgumentException("%d-bit images need a bin for every pixel value (at least %d bins)", 8 * (int)sizeof(T), 1 << (8 * sizeof(T)));
+}
+
+//pixels counted by the approximate histogram of an image of pixel_count pixels - one per block of sample_rate pixels
+inline int SampledPixelCount(int pixel_count, int sample_rate) {
+	return (pixel_count + sample_rate - 1) / sample_rate;
+}
+
+//largest difference, in output levels, between the look-up table of a histogram of sample_count sampled pixels and the exact table that holds
+//with the given confidence - the Dvoretzky-Kiefer-Wolfowitz bound on the error of the sampled cumulative distribution, scaled to the bins,
+//plus one level for the integer normalisation; stratified sampling is at least as accurate as the independent samples the bound assumes
+inline int SampledLutErrorBound(int sample_count, int bin_count, double confidence = 0.99) {
+	double epsilon = sqrt(log(2.0 / (1.0 - confidence)) / (2.0 * std::max(sample_count, 1)));
+	return std::min((int)ceil(epsilon * bin_count) + 1, bin_count - 1);
+}
+
+//look-up table of a histogram with 64-bit counts, scanned and normalised on the host - the arithmetic of norm_value ("scale") or norm_hist_cdf ("cdf")
+//with every count in 64 bits, for totals that don't fit the 32-bit counts of the device kernels; pixel_max is the largest pixel value
+vector<int> HostLookUpTable(const vector<unsigned long long>& histogram, const string& norm_variant, int pixel_max) {
+	const unsigned long long bin_size = histogram.size();
+	vector<unsigned long long> cum(histogram.size());
+	unsigned long long sum = 0;
+	for (size_t bin = 0; bin < cum.size(); bin++) {
+		sum += histogram[bin];
+		cum[bin] = sum;
+	}
+
+	vector<int> lut(histogram.size());
+	if (norm_variant == "cdf") {
+		vector<unsigned long long>::const_iterator first = std::find_if(cum.begin(), cum.end(), [](unsigned long long value) { return value != 0; });
+		const unsigned long long cdf_min = (first != cum.end()) ? *first : 0, total = cum.back();
+		const unsigned long long last_level = std::min(bin_size, (unsigned long long)pixel_max + 1) - 1;
+		for (size_t bin = 0; bin < cum.size(); bin++) {
+			unsigned long long value = bin;
+			if (total != cdf_min) //a single value is left as it is
+				value = (cum[bin] > cdf_min) ? ((cum[bin] - cdf_min) * last_level + (total - cdf_min) / 2) / (total - cdf_min) : 0;
+			lut[bin] = (int)std::min(value, last_level);
+		}
+	}
+	else {
+		const unsigned long long scale = std::max(cum.back() / bin_size, 1ULL);
+		const unsigned long long last_level = std::min(bin_size, (unsigned long long)pixel_max + 1) - 1;
+		for (size_t bin = 0; bin < cum.size(); bin++)
+			lut[bin] = (int)std::min(cum[bin] / scale, last_level);
+	}
+	return lut;
+}
+
+//work group size for kernels that run over the image on device - requested (0 to choose automatically) limited to what every kernel supports
+//the automatic size is the largest multiple of the device's preferred multiple up to 256, which keeps SIMD lanes full without limiting the work groups per compute unit
+size_t ImageWorkGroupSize(const cl::Device& device, const vector<cl::Kernel>& kernels, size_t requested) {
+	size_t kernel_max_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	for (size_t i = 0; i < kernels.size(); i++)
+		kernel_max_size = std::min(kernel_max_size, kernels[i].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	size_t preferred_multiple = kernels[0].getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+
+	if (requested > 0) {
+		if (requested > kernel_max_size)
+			std::cerr << "WARNING: work group size limited to " << kernel_max_size << " on " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+		return std::min(requested, kernel_max_size);
+	}
+
+	size_t size = std::min((size_t)256, kernel_max_size) / preferred_multiple * preferred_multiple;
+	return (size > 0) ? size : kernel_max_size; //preferred multiple larger than the kernels allow
+}
+
+//work group size of the scans of bin_count bins - one work item per bin, limited to what every scan kernel of program supports on the device
+//CL_KERNEL_WORK_GROUP_SIZE accounts for the registers and local memory of each kernel, so it can be below CL_DEVICE_MAX_WORK_GROUP_SIZE
+size_t ScanWorkGroupSize(const cl::Device& device, const cl::Program& program, int bin_count) {
+	const char* scan_kernels[] = { "cum_hist", "cum_hist_norm", "cum_hist_block", "cum_hist_add", "cum_hist_add_norm", "cum_hist_blelloch", "cum_hist_blelloch_norm" };
+	size_t size = std::min((size_t)bin_count, (size_t)device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+	for (size_t i = 0; i < sizeof(scan_kernels) / sizeof(scan_kernels[0]); i++)
+		size = std::min(size, cl::Kernel(program, scan_kernels[i]).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	return std::max(size, (size_t)1);
+}
+
+//true if the device supports images and the context can create read-only 2D images of format
+bool ImageFormatSupported(const cl::Context& context, const cl::Device& device, const cl::ImageFormat& format) {
+	if (!device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
+		return false;
+
+	vector<cl::ImageFormat> formats;
+	context.getSupportedImageFormats(CL_MEM_READ_ONLY, CL_MEM_OBJECT_IMAGE2D, &formats);
+	for (size_t i = 0; i < formats.size(); i++) {
+		if ((formats[i].image_channel_order == format.image_channel_order) && (formats[i].image_channel_data_type == format.image_channel_data_type))
+			return true;
+	}
+	return false;
+}
+
+//buffer for the block totals of one level of a hierarchical scan - taken from block_sums_cache[level] if that is big enough, otherwise created
+//and kept there, so that repeated scans of the same size allocate nothing after the first one
+cl::Buffer ScanBlockSums(const cl::Context& context, int block_count, vector<cl::Buffer>* block_sums_cache, size_t level) {
+	size_t bytes = block_count * sizeof(int);
+	if (block_sums_cache == NULL)
+		return cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+
+	if (block_sums_cache->size() <= level)
+		block_sums_cache->resize(level + 1);
+	cl::Buffer& cached = (*block_sums_cache)[level];
+	if ((cached() == NULL) || (cached.getInfo<CL_MEM_SIZE>() < bytes))
+		cached = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+	return cached;
+}
+
+//scan kernels of one queue owner, each created on its first use and reused by every later scan; the levels of a hierarchical scan share them,
+//as the arguments are captured when a kernel is enqueued, but concurrent callers each need their own as setArg isn't thread safe
+struct ScanKernels {
+	cl::Kernel cum_hist, cum_hist_norm, cum_hist_block, cum_hist_add, cum_hist_add_norm, cum_hist_blelloch, cum_hist_blelloch_norm;
+};
+
+//kernel name of program - taken from cached if that has been created, otherwise created and kept there (if given)
+cl::Kernel ScanKernel(const cl::Program& program, const char* name, cl::Kernel* cached) {
+	if (cached == NULL)
+		return cl::Kernel(program, name);
+	if ((*cached)() == NULL)
+		*cached = cl::Kernel(program, name);
+	return *cached;
+}
+
+//enqueues a work-efficient Blelloch inclusive scan of the first bin_size values of input into output
+//each work group of scan_local_size (rounded down to a power of two) scans a block of twice as many values
+//the scan waits for wait_events and done_event (if given) is set to the last command enqueued
+//if lut is given, the last stage also writes the normalised look-up table for an image of image_size pixels into it
+//if profile is given, the event of every kernel enqueued is appended to it
+//block_sums_cache (if given) keeps the block totals buffers of every level of the scan between calls, see ScanBlockSums, and kernels (if given) its kernels
+void EnqueueBlellochCumHist(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& input, const cl::Buffer& output, int bin_size, size_t scan_local_size,
+	const vector<cl::Event>* wait_events, cl::Event* done_event, const cl::Buffer* lut = NULL, int image_size = 0, vector<ProfiledEvent>* profile = NULL,
+	vector<cl::Buffer>* block_sums_cache = NULL, size_t cache_level = 0, ScanKernels* kernels = NULL) {
+	size_t pow2_local_size = 1;
+	while (pow2_local_size * 2 <= scan_local_size)
+		pow2_local_size *= 2;
+	while ((pow2_local_size > 1) && (pow2_local_size >= (size_t)bin_size)) //no point in launching more than half the values' worth of work items
+		pow2_local_size /= 2;
+
+	size_t block_size = 2 * pow2_local_size;
+	int block_count = (bin_size + (int)block_size - 1) / (int)block_size;
+	cl::Buffer block_sums = ScanBlockSums(context, block_count, block_sums_cache, cache_level); //totals of each block, scanned in place below
+	cl::Event scan_event;
+
+	cl::Kernel kernel_scan;
+	if ((lut != NULL) && (block_count == 1)) { //a single block can write the look-up table directly
+		kernel_scan = ScanKernel(program, "cum_hist_blelloch_norm", (kernels != NULL) ? &kernels->cum_hist_blelloch_norm : NULL);
+		kernel_scan.setArg(0, input);
+		kernel_scan.setArg(1, *lut);
+		kernel_scan.setArg(2, block_sums);
+		kernel_scan.setArg(3, cl::Local((block_size + (block_size >> 5)) * sizeof(int)));
+		kernel_scan.setArg(4, image_size);
+		kernel_scan.setArg(5, bin_size);
+	}
+	else {
+		kernel_scan = ScanKernel(program, "cum_hist_blelloch", (kernels != NULL) ? &kernels->cum_hist_blelloch : NULL);
+		kernel_scan.setArg(0, input);
+		kernel_scan.setArg(1, output);
+		kernel_scan.setArg(2, block_sums);
+		kernel_scan.setArg(3, cl::Local((block_size + (block_size >> 5)) * sizeof(int)));//block plus one padding element per 32 values (LOG_NUM_BANKS)
+		kernel_scan.setArg(4, bin_size);
+	}
+
+	queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(block_count * pow2_local_size), cl::NDRange(pow2_local_size), wait_events, &scan_event);
+	if (profile != NULL)
+		profile->push_back(ProfiledEvent(kernel_scan.getInfo<CL_KERNEL_FUNCTION_NAME>(), scan_event, 2 * (size_t)bin_size * sizeof(int)));
+
+	if (block_count == 1) {
+		if (done_event != NULL)
+			*done_event = scan_event;
+		return;
+	}
+
+	vector<cl::Event> scan_wait(1, scan_event);
+	vector<cl::Event> sums_wait(1);
+	EnqueueBlellochCumHist(context, queue, program, block_sums, block_sums, block_count, scan_local_size, &scan_wait, &sums_wait[0], NULL, 0, profile, block_sums_cache, cache_level + 1, kernels);
+
+	cl::Kernel kernel_add;
+	if (lut != NULL) {
+		kernel_add = ScanKernel(program, "cum_hist_add_norm", (kernels != NULL) ? &kernels->cum_hist_add_norm : NULL);
+		kernel_add.setArg(0, output);
+		kernel_add.setArg(1, block_sums);
+		kernel_add.setArg(2, *lut);
+		kernel_add.setArg(3, int(block_size));
+		kernel_add.setArg(4, image_size);
+		kernel_add.setArg(5, bin_size);
+	}
+	else {
+		kernel_add = ScanKernel(program, "cum_hist_add", (kernels != NULL) ? &kernels->cum_hist_add : NULL);
+		kernel_add.setArg(0, output);
+		kernel_add.setArg(1, block_sums);
+		kernel_add.setArg(2, int(block_size));
+		kernel_add.setArg(3, bin_size);
+	}
+
+	cl::Event add_event;
+	queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(block_count * block_size), cl::NDRange(pow2_local_size), &sums_wait, &add_event);
+	if (profile != NULL)
+		profile->push_back(ProfiledEvent(kernel_add.getInfo<CL_KERNEL_FUNCTION_NAME>(), add_event, 2 * (size_t)bin_size * sizeof(int)));
+	if (done_event != NULL)
+		*done_event = add_event;
+}
+
+//enqueues an inclusive scan of the first bin_size values of input into output using work groups of scan_local_size
+//scan_variant selects the Hillis-Steele ("hs") or Blelloch ("blelloch") scan
+//a single work group is used when all the values fit, otherwise blocks are scanned separately and the scanned block totals are added back
+//the scan waits for wait_events and done_event (if given) is set to the last command enqueued
+//if lut is given, norm_hist is fused into the last stage, which also writes the normalised look-up table for an image of image_size pixels into it
+//if profile is given, the event of every kernel enqueued is appended to it
+//block_sums_cache (if given) keeps the block totals buffers of every level of the scan between calls, see ScanBlockSums, and kernels (if given) its kernels
+void EnqueueCumHist(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program, const cl::Buffer& input, const cl::Buffer& output, int bin_size, size_t scan_local_size, const string& scan_variant,
+	const vector<cl::Event>* wait_events = NULL, cl::Event* done_event = NULL, const cl::Buffer* lut = NULL, int image_size = 0, vector<ProfiledEvent>* profile = NULL,
+	vector<cl::Buffer>* block_sums_cache = NULL, size_t cache_level = 0, ScanKernels* kernels = NULL) {
+	if (scan_variant == "blelloch") {
+		EnqueueBlellochCumHist(context, queue, program, input, output, bin_size, scan_local_size, wait_events, done_event, lut, image_size, profile, block_sums_cache, cache_level, kernels);
+		return;
+	}
+
+	if (bin_size <= (int)scan_local_size) {
+		cl::Kernel kernel_cum;
+		if (lut != NULL) {
+			kernel_cum = ScanKernel(program, "cum_hist_norm", (kernels != NULL) ? &kernels->cum_hist_norm : NULL);
+			kernel_cum.setArg(0, input);
+			kernel_cum.setArg(1, *lut);
+			kernel_cum.setArg(2, cl::Local(bin_size * sizeof(int)));
+			kernel_cum.setArg(3, cl::Local(bin_size * sizeof(int)));
+			kernel_cum.setArg(4, image_size);
+			kernel_cum.setArg(5, bin_size);
+		}
+		else {
+			kernel_cum = ScanKernel(program, "cum_hist", (kernels != NULL) ? &kernels->cum_hist : NULL);
+			kernel_cum.setArg(0, input);
+			kernel_cum.setArg(1, output);
+			kernel_cum.setArg(2, cl::Local(bin_size * sizeof(int)));//local memory size - arguments for kernel function!!
+			kernel_cum.setArg(3, cl::Local(bin_size * sizeof(int)));//local memory size - arguments for kernel function!! - for scan_add second buffer
+		}
+
+		cl::Event cum_event;
+		queue.enqueueNDRangeKernel(kernel_cum, cl::NullRange, cl::NDRange(bin_size), cl::NDRange(bin_size), wait_events, &cum_event);
+		if (profile != NULL)
+			profile->push_back(ProfiledEvent(kernel_cum.getInfo<CL_KERNEL_FUNCTION_NAME>(), cum_event, 2 * (size_t)bin_size * sizeof(int)));
+		if (done_event != NULL)
+			*done_event = cum_event;
+		return;
+	}
+
+	int block_count = (bin_size + (int)scan_local_size - 1) / (int)scan_local_size;
+	cl::Buffer block_sums = ScanBlockSums(context, block_count, block_sums_cache, cache_level); //totals of each block, scanned in place below
+	cl::Event block_event;
+
+	cl::Kernel kernel_block = ScanKernel(program, "cum_hist_block", (kernels != NULL) ? &kernels->cum_hist_block : NULL);
+	kernel_block.setArg(0, input);
+	kernel_block.setArg(1, output);
+	kernel_block.setArg(2, block_sums);
+	kernel_block.setArg(3, cl::Local(scan_local_size * sizeof(int)));
+	kernel_block.setArg(4, cl::Local(scan_local_size * sizeof(int)));
+	kernel_block.setArg(5, bin_size);
+
+	queue.enqueueNDRangeKernel(kernel_block, cl::NullRange, cl::NDRange(block_count * scan_local_size), cl::NDRange(scan_local_size), wait_events, &block_event);
+	if (profile != NULL)
+		profile->push_back(ProfiledEvent("cum_hist_block", block_event, 2 * (size_t)bin_size * sizeof(int)));
+
+	vector<cl::Event> block_wait(1, block_event);
+	vector<cl::Event> sums_wait(1);
+	EnqueueCumHist(context, queue, program, block_sums, block_sums, block_count, scan_local_size, scan_variant, &block_wait, &sums_wait[0], NULL, 0, profile, block_sums_cache, cache_level + 1, kernels);
+
+	cl::Kernel kernel_add;
+	if (lut != NULL) {
+		kernel_add = ScanKernel(program, "cum_hist_add_norm", (kernels != NULL) ? &kernels->cum_hist_add_norm : NULL);
+		kernel_add.setArg(0, output);
+		kernel_add.setArg(1, block_sums);
+		kernel_add.setArg(2, *lut);
+		kernel_add.setArg(3, int(scan_local_size));
+		kernel_add.setArg(4, image_size);
+		kernel_add.setArg(5, bin_size);
+	}
+	else {
+		kernel_add = ScanKernel(program, "cum_hist_add", (kernels != NULL) ? &kernels->cum_hist_add : NULL);
+		kernel_add.setArg(0, output);
+		kernel_add.setArg(1, block_sums);
+		kernel_add.setArg(2, int(scan_local_size));
+		kernel_add.setArg(3, bin_size);
+	}
+
+	cl::Event add_event;
+	queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(block_count * scan_local_size), cl::NDRange(scan_local_size), &sums_wait, &add_event);
+	if (profile != NULL)
+		profile->push_back(ProfiledEvent(kernel_add.getInfo<CL_KERNEL_FUNCTION_NAME>(), add_event, 2 * (size_t)bin_size * sizeof(int)));
+	if (done_event != NULL)
+		*done_event = add_event;
+}
+
+//OpenCL C name of a host pixel type, passed to the kernels as -DPIXEL_TYPE
+//ImageChannelType is the normalised single channel type that holds it in an image object
+template <typename T> struct PixelType;
+template <> struct PixelType<unsigned char> { static const char* Name() { return "uchar"; } static cl_channel_type ImageChannelType() { return CL_UNORM_INT8; } };
+template <> struct PixelType<unsigned short> { static const char* Name() { return "ushort"; } static cl_channel_type ImageChannelType() { return CL_UNORM_INT16; } };
+
+//equalises images of pixel type T (8 or 16-bit) on one device
+//the queues and the built program are created once and the device buffers are only reallocated when an image is larger than any seen before,
+//so that many images can be processed without paying the OpenCL start-up cost again
+//the work is spread over slot_count slots, each with its own in-order queue and buffers - Equalise runs synchronously on slot 0,
+//while Submit/Collect let the upload of one image, the kernels of another and the download of a third run on the device at the same time
+//with options.sample_rate above 1 the histogram is approximated from one pixel in every sample_rate (flat global equalisation only), which
+//is enough for previews - the rest of the pipeline is unchanged, with the look-up table normalised for the number of samples
+//with options.use_image the input is uploaded as a single channel cl::Image2D (the planes stacked one below another) and the image kernels read it
+//through a sampler, so that 2D neighbourhoods are served by the texture cache - devices without image support fall back to the buffer path
+//options.bin_count must cover every pixel value - at least 256 for 8-bit and 65536 for 16-bit images - and the look-up table is clamped to the pixel type
+template <typename T>
+class BasicEqualiser {
+public:
+	BasicEqualiser(const cl::Context& context, const EqualisationOptions& options, int slot_count = 1) :
+		context(context), options(options), image_max_width(0), image_max_height(0), slots(std::max(slot_count, 1)) {
+		CheckBinCount<T>(options.bin_count);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+		//a privatised histogram of every bin has to fit in local memory, which 65536 bins usually don't
+		if ((this->options.hist_variant == "local") && ((size_t)options.bin_count * sizeof(int) > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())) {
+			std::cerr << "WARNING: " << options.bin_count << " bins do not fit in local memory, using the atomic histogram kernel" << std::endl;
+			this->options.hist_variant = "atomic";
+		}
+
+		//Load & build the device code specialised for the pixel type, reusing a cached binary from an earlier run if there is one
+		string build_options = string("-DPIXEL_TYPE=") + PixelType<T>::Name();
+		program = BuildProgram(context, "kernels/my_kernels.cl", build_options, options.use_program_cache, &program_from_cache);
+
+		//local size of the scans set to number of bins, limited to the largest work group the scan kernels support on the device
+		local_size = ScanWorkGroupSize(device, program, options.bin_count);
+
+		size_t hist_size = (size_t)options.bin_count * sizeof(int);
+		for (size_t i = 0; i < slots.size(); i++) {
+			//create a queue to which we will push commands for the device - one per slot so that the slots can overlap
+			slots[i].queue = cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE);
+			slots[i].int_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size); //cleared by a fill before every image
+			slots[i].cum_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+			slots[i].norm_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, hist_size);
+		}
+
+		bool vectorised = (options.pixels_per_item >= 16);
+		if (this->options.hist_variant == "local")
+			kernel_hist = cl::Kernel(program, "int_hist_local");
+		else
+			kernel_hist = cl::Kernel(program, vectorised ? "int_hist_vec" : "int_hist");
+		kernel_hist_sampled = cl::Kernel(program, "int_hist_sampled");
+		kernel_norm = cl::Kernel(program, (options.norm_variant == "cdf") ? "norm_hist_cdf" : "norm_hist");
+		kernel_output = cl::Kernel(program, vectorised ? "back_project_vec" : "back_project");
+		kernel_hist_luma = cl::Kernel(program, "int_hist_luma");
+		kernel_output_luma = cl::Kernel(program, "back_project_luma");
+		kernel_tile_hist = cl::Kernel(program, "tile_hist");
+		kernel_clip = cl::Kernel(program, "clip_hist");
+		kernel_tile_lut = cl::Kernel(program, "tile_lut");
+		kernel_output_clahe = cl::Kernel(program, "back_project_clahe");
+
+		//the per-tile kernels reduce and scan with a power of two work group, at most one work item per bin
+		size_t tile_max_size = std::min(local_size, std::min(kernel_clip.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), kernel_tile_lut.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)));
+		tile_local_size = 1;
+		while (tile_local_size * 2 <= tile_max_size)
+			tile_local_size *= 2;
+
+		//work group size of the image kernels - they don't depend on the number of bins
+		vector<cl::Kernel> image_kernels = { kernel_hist, kernel_output, kernel_hist_luma, kernel_output_luma, kernel_tile_hist, kernel_output_clahe, kernel_hist_sampled };
+
+		//the image object kernels are only built on devices that support images in the single channel format of the pixel type
+		image_format = cl::ImageFormat(CL_R, PixelType<T>::ImageChannelType());
+		if (this->options.use_image && !ImageFormatSupported(context, device, image_format)) {
+			std::cerr << "WARNING: " << device.getInfo<CL_DEVICE_NAME>() << " does not support CL_R images of this pixel type, using buffers" << std::endl;
+			this->options.use_image = false;
+		}
+		if (this->options.use_image) {
+			kernel_hist_image = cl::Kernel(program, "int_hist_image");
+			kernel_output_image = cl::Kernel(program, "back_project_image");
+			kernel_tile_hist_image = cl::Kernel(program, "tile_hist_image");
+			kernel_output_clahe_image = cl::Kernel(program, "back_project_clahe_image");
+			image_kernels.insert(image_kernels.end(), { kernel_hist_image, kernel_output_image, kernel_tile_hist_image, kernel_output_clahe_image });
+			image_max_width = device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>();
+			image_max_height = device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>();
+		}
+		image_local_size = ImageWorkGroupSize(device, image_kernels, options.work_group_size);
+	}
+
+	//work group size used for the image kernels on this device
+	size_t WorkGroupSize() const { return image_local_size; }
+
+	~BasicEqualiser() {
+		for (size_t i = 0; i < slots.size(); i++) {
+			try {
+				ReleaseHostMemory(slots[i]);
+			}
+			catch (const cl::Error&) {
+			}
+		}
+	}
+
+	//equalises input into output, which is resized to match the input
+	//with pinned or zero-copy host memory the output shares the equaliser's host memory and is only valid until the next call
+	void Equalise(const CImg<T>& image_input, CImg<T>& output_image) {
+		Slot& slot = slots[0];
+		Collect(0); //finish any streamed work that still uses the slot
+
+		Enqueue(slot, image_input, output_image, options.resident, true);
+	}
+
+	int SlotCount() const { return (int)slots.size(); }
+
+	//host image of a slot - load the next image into it, then call Submit
+	CImg<T>& SlotInput(int slot) { return slots[slot].input; }
+
+	//enqueues the upload, equalisation and download of the image in SlotInput(slot) and returns without waiting
+	//the slot's input must not be modified until Collect(slot) has been called
+	void Submit(int slot) {
+		Slot& s = slots[slot];
+		Collect(slot);
+
+		Enqueue(s, s.input, s.output, true, false);
+		s.queue.flush(); //start the slot now rather than when the driver decides to
+		s.busy = true;
+	}
+
+	//waits for the image submitted to a slot and returns the equalised result
+	const CImg<T>& Collect(int slot) {
+		Slot& s = slots[slot];
+		if (s.busy) {
+			s.output_event.wait();
+			s.busy = false;
+		}
+		return s.output;
+	}
+
+	//true if the program binary was loaded from the cache rather than compiled
+	bool ProgramFromCache() const { return program_from_cache; }
+
+	//program the kernels come from, e.g. to query their resource usage
+	const cl::Program& Program() const { return program; }
+
+	//pixels sampled for the approximate histogram of the last image equalised on a slot, 0 if it had the exact histogram
+	int SampleCount(int slot = 0) const { return slots[slot].sample_count; }
+
+	//normalised look-up table of the last image equalised globally on a slot, read back from the device
+	vector<int> LookUpTable(int slot = 0) {
+		Collect(slot);
+		vector<int> lut(options.bin_count);
+		slots[slot].queue.enqueueReadBuffer(slots[slot].norm_histogram, CL_TRUE, 0, lut.size() * sizeof(int), &lut[0]);
+		return lut;
+	}
+
+	//true if images are read through image objects, false if they are read from buffers (options.use_image not set, or not supported)
+	bool UsesImages() const { return options.use_image; }
+
+	//events of every upload, kernel and readback of the last image equalised on a slot, in the order they were enqueued
+	const vector<ProfiledEvent>& Profile(int slot = 0) const { return slots[slot].profile; }
+
+private:
+	//queue, device buffers and host images of one image in flight
+	struct Slot {
+		Slot() : image_capacity(0), input_capacity(0), zero_copy_host(NULL), image_width(0), image_rows(0), sample_count(0), busy(false), pinned_input_ptr(NULL), pinned_output_ptr(NULL), mapped_output_ptr(NULL), tile_capacity(0) {}
+
+		cl::CommandQueue queue;
+		size_t image_capacity; //size of the device output (and pinned staging) buffers in bytes
+		size_t input_capacity; //size of dev_image_input in bytes
+		const T* zero_copy_host; //host image dev_image_input wraps in zero-copy mode
+		cl::Buffer dev_image_input; //linear input, only created for the buffer kernels
+		cl::Buffer dev_image_output;
+		cl::Image2D dev_image_2d; //input of the image object path, recreated when the image dimensions change
+		size_t image_width;
+		size_t image_rows; //height of every plane stacked
+		cl::Buffer int_histogram;
+		cl::Buffer cum_histogram;
+		cl::Buffer norm_histogram;
+		vector<cl::Buffer> scan_block_sums; //block totals of the hierarchical scans, kept between images
+		ScanKernels scan_kernels;
+		int sample_count; //pixels sampled for the histogram of the last image, 0 for the exact histogram
+
+		CImg<T> input;
+		CImg<T> output;
+		bool busy; //submitted and not yet collected
+
+		cl::Event kernel_event; //back_project
+		cl::Event output_event; //download of the output image
+		vector<ProfiledEvent> profile;
+
+		cl::Buffer pinned_input; //page-locked staging buffers of the pinned mode, mapped for as long as they exist
+		cl::Buffer pinned_output;
+		T* pinned_input_ptr;
+		T* pinned_output_ptr;
+		T* mapped_output_ptr; //dev_image_output as mapped in zero-copy mode, NULL while the device owns it
+
+		size_t tile_capacity; //size of the adaptive equalisation buffers in bytes
+		cl::Buffer tile_histograms;
+		cl::Buffer tile_luts;
+	};
+
+	//unmaps every buffer the slot has mapped for host access
+	void ReleaseHostMemory(Slot& slot) {
+		if (slot.mapped_output_ptr != NULL)
+			slot.queue.enqueueUnmapMemObject(slot.dev_image_output, slot.mapped_output_ptr);
+		if (slot.pinned_input_ptr != NULL)
+			slot.queue.enqueueUnmapMemObject(slot.pinned_input, slot.pinned_input_ptr);
+		if (slot.pinned_output_ptr != NULL)
+			slot.queue.enqueueUnmapMemObject(slot.pinned_output, slot.pinned_output_ptr);
+		slot.mapped_output_ptr = slot.pinned_input_ptr = slot.pinned_output_ptr = NULL;
+		if (slot.output.is_shared())
+			slot.output.assign(); //the shared output pointed into the memory that was just unmapped
+		slot.queue.finish();
+	}
+
+	//enqueues the whole pipeline for image_input on the slot's queue, downloading the result into output_image
+	//resident uploads without blocking and chains the stages through events, blocking_output waits for the download
+	//in pinned mode the image is staged through page-locked buffers and output_image shares the pinned output buffer,
+	//in zero-copy mode the device reads image_input's own memory and output_image shares the mapped device output buffer
+	void Enqueue(Slot& slot, const CImg<T>& image_input, CImg<T>& output_image, bool resident, bool blocking_output) {
+		//colour images in luma mode are equalised per pixel rather than per value, so the histogram counts pixels and the kernels run once per pixel
+		const bool luma = (options.colour_mode == "luma") && (image_input.spectrum() == 3);
+		const int image_size = luma ? image_input.width() * image_input.height() * image_input.depth() : image_input.size();
+		const size_t image_bytes = image_input.size() * sizeof(T);
+
+		//the vector kernels handle pixels_per_item pixels in each work item (the last pixels of the image being spread over the first work items)
+		//and stride over the image, so their global size can be rounded up to a whole number of work groups
+		const bool vectorised = (options.pixels_per_item >= 16) && !luma;
+		size_t vector_global_size = (image_size + options.pixels_per_item - 1) / options.pixels_per_item;
+		vector_global_size = RoundUp(std::max(vector_global_size, (size_t)1), image_local_size);
+		const size_t padded_image_size = RoundUp(image_size, image_local_size); //one work item per pixel, padded to whole work groups
+		cl::CommandQueue& queue = slot.queue;
+		bool pinned = (options.host_memory == "pinned");
+		bool zero_copy = (options.host_memory == "zerocopy");
+
+		//the approximate histogram samples the flat image buffer, so it replaces the image object path as well as the other histogram kernels
+		const bool sampled = (options.sample_rate > 1) && !luma && (options.clahe_tiles_x == 0);
+		const int histogram_count = sampled ? SampledPixelCount(image_size, options.sample_rate) : image_size; //pixels the look-up table is normalised for
+		slot.sample_count = sampled ? histogram_count : 0;
+
+		//the image object path covers the flat and adaptive pipelines, and is skipped for zero-copy input and images larger than the device allows
+		const size_t image_rows = (size_t)image_input.height() * image_input.depth() * image_input.spectrum();
+		bool image_path = options.use_image && !zero_copy && !sampled && (!luma || (options.clahe_tiles_x > 0));
+		if (image_path && (((size_t)image_input.width() > image_max_width) || (image_rows > image_max_height))) {
+			std::cerr << "WARNING: " << image_input.width() << "x" << image_rows << " is larger than the largest image object, using buffers" << std::endl;
+			image_path = false;
+		}
+
+		if (slot.mapped_output_ptr != NULL) { //hand the zero-copy output of the previous image back to the device
+			queue.enqueueUnmapMemObject(slot.dev_image_output, slot.mapped_output_ptr);
+			slot.mapped_output_ptr = NULL;
+			output_image.assign();
+		}
+
+		//device - buffers, grown when the image does not fit in the ones from the previous call
+		if (image_bytes > slot.image_capacity) {
+			ReleaseHostMemory(slot);
+			if (&output_image != &slot.output)
+				output_image.assign();
+			slot.dev_image_output = cl::Buffer(context, zero_copy ? (CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR) : CL_MEM_READ_WRITE, image_bytes); //should be the same as input image
+			if (pinned) {
+				slot.pinned_input = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, image_bytes);
+				slot.pinned_output = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, image_bytes);
+				slot.pinned_input_ptr = (T*)queue.enqueueMapBuffer(slot.pinned_input, CL_TRUE, CL_MAP_WRITE, 0, image_bytes);
+				slot.pinned_output_ptr = (T*)queue.enqueueMapBuffer(slot.pinned_output, CL_TRUE, CL_MAP_READ, 0, image_bytes);
+			}
+			slot.image_capacity = image_bytes;
+		}
+
+		//zero copy - the input buffer is wrapped around the host image itself (this is only free if the driver accepts its alignment, otherwise it copies),
+		//and kept for as long as the host image stays at the same address and size
+		bool zero_copy_reused = zero_copy && (slot.zero_copy_host == image_input.data()) && (slot.input_capacity == image_bytes);
+		if (zero_copy && !zero_copy_reused) {
+			slot.dev_image_input = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, image_bytes, const_cast<T*>(image_input.data()));
+			slot.zero_copy_host = image_input.data();
+			slot.input_capacity = image_bytes;
+		}
+		else if (!zero_copy && !image_path && (image_bytes > slot.input_capacity)) { //the image object path reads dev_image_2d instead
+			slot.dev_image_input = cl::Buffer(context, CL_MEM_READ_ONLY, image_bytes);
+			slot.input_capacity = image_bytes;
+		}
+
+		//pinned - one host copy into page-locked memory, from which the driver can DMA without its own staging copy
+		const T* upload_source = image_input.data();
+		if (pinned) {
+			memcpy(slot.pinned_input_ptr, image_input.data(), image_bytes);
+			upload_source = slot.pinned_input_ptr;
+		}
+
+		//events of each stage - in resident mode every stage waits on the one before it instead of on the blocking upload
+		vector<cl::Event> upload_wait;
+		vector<cl::Event> hist_wait(1);
+		vector<cl::Event> scan_wait(1);
+		vector<cl::Event> norm_wait(1);
+
+		vector<ProfiledEvent>& profile = slot.profile;
+		profile.clear();
+
+		//int_hist counts into a histogram that starts at zero - the slot's histogram is cleared on the device rather than allocated again
+		if (options.clahe_tiles_x == 0) {
+			cl::Event clear_event;
+			queue.enqueueFillBuffer(slot.int_histogram, 0, 0, (size_t)options.bin_count * sizeof(int), NULL, &clear_event);
+			profile.push_back(ProfiledEvent("clear histogram", clear_event, (size_t)options.bin_count * sizeof(int)));
+			upload_wait.push_back(clear_event); //the histogram kernel waits on both the clear and the upload
+		}
+
+		//Copy images to device memory
+		if (image_path) {
+			if ((slot.image_width != (size_t)image_input.width()) || (slot.image_rows != image_rows)) {
+				slot.dev_image_2d = cl::Image2D(context, CL_MEM_READ_ONLY, image_format, image_input.width(), image_rows);
+				slot.image_width = image_input.width();
+				slot.image_rows = image_rows;
+			}
+			cl::array<cl::size_type, 3> origin = { 0, 0, 0 };
+			cl::array<cl::size_type, 3> region = { slot.image_width, slot.image_rows, 1 };
+			cl::Event upload_event;
+			queue.enqueueWriteImage(slot.dev_image_2d, resident ? CL_FALSE : CL_TRUE, origin, region, 0, 0, upload_source, NULL, &upload_event);
+			profile.push_back(ProfiledEvent("upload image", upload_event, image_bytes));
+			upload_wait.push_back(upload_event);
+		}
+		else if (!zero_copy) {
+			cl::Event upload_event;
+			queue.enqueueWriteBuffer(slot.dev_image_input, resident ? CL_FALSE : CL_TRUE, 0, image_bytes, upload_source, NULL, &upload_event);
+			profile.push_back(ProfiledEvent("upload input", upload_event, image_bytes));
+			upload_wait.push_back(upload_event);
+		}
+		else if (zero_copy_reused) { //nothing to upload, but the host may have rewritten the image - a map and unmap hands the new contents to the device
+			cl::Event unmap_event;
+			void* mapped = queue.enqueueMapBuffer(slot.dev_image_input, resident ? CL_FALSE : CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, image_bytes);
+			queue.enqueueUnmapMemObject(slot.dev_image_input, mapped, NULL, &unmap_event);
+			if (!resident)
+				unmap_event.wait();
+			profile.push_back(ProfiledEvent("sync input", unmap_event, image_bytes));
+			upload_wait.push_back(unmap_event);
+		}
+
+		if (options.clahe_tiles_x > 0) { //adaptive equalisation replaces the whole global histogram pipeline
+			EnqueueClahe(slot, image_input, (resident && !upload_wait.empty()) ? &upload_wait : NULL, image_path);
+			EnqueueDownload(slot, image_input, output_image, resident, blocking_output);
+			return;
+		}
+
+		cl::NDRange image_global_2d, image_local_2d;
+		if (image_path)
+			ImageRange2D(slot, image_global_2d, image_local_2d);
+
+		//Setup and execute the kernel (i.e. device code)
+		if (image_path) {
+			kernel_hist_image.setArg(0, slot.dev_image_2d);
+			kernel_hist_image.setArg(1, slot.int_histogram);
+			queue.enqueueNDRangeKernel(kernel_hist_image, cl::NullRange, image_global_2d, image_local_2d, resident ? &upload_wait : NULL, &hist_wait[0]);
+			profile.push_back(ProfiledEvent("int_hist_image", hist_wait[0], image_bytes));
+		}
+		else if (sampled) {
+			kernel_hist_sampled.setArg(0, slot.dev_image_input);
+			kernel_hist_sampled.setArg(1, slot.int_histogram);
+			kernel_hist_sampled.setArg(2, options.sample_rate);
+			kernel_hist_sampled.setArg(3, histogram_count);
+			kernel_hist_sampled.setArg(4, image_size);
+			queue.enqueueNDRangeKernel(kernel_hist_sampled, cl::NullRange, cl::NDRange(RoundUp(histogram_count, image_local_size)), cl::NDRange(image_local_size),
+				(resident && !upload_wait.empty()) ? &upload_wait : NULL, &hist_wait[0]);
+			profile.push_back(ProfiledEvent("int_hist_sampled", hist_wait[0], histogram_count * sizeof(T)));
+		}
+		else {
+			cl::Kernel& hist = luma ? kernel_hist_luma : kernel_hist; //colour images always use the global atomic luminance histogram
+			hist.setArg(0, slot.dev_image_input);
+			hist.setArg(1, slot.int_histogram);
+			if (luma) {
+				hist.setArg(2, image_size);
+				hist.setArg(3, options.bin_count);
+			}
+			else if (options.hist_variant == "local") {
+				hist.setArg(2, cl::Local((size_t)options.bin_count * sizeof(int)));//local histogram - one copy of the bins per work group
+				hist.setArg(3, options.bin_count);
+				hist.setArg(4, image_size);
+			}
+			else {
+				hist.setArg(2, image_size);
+			}
+
+			bool hist_vectorised = vectorised && (options.hist_variant != "local"); //the privatised histogram has no vector variant
+			queue.enqueueNDRangeKernel(hist, cl::NullRange, cl::NDRange(hist_vectorised ? vector_global_size : padded_image_size), cl::NDRange(image_local_size), (resident && !upload_wait.empty()) ? &upload_wait : NULL, &hist_wait[0]);
+			profile.push_back(ProfiledEvent(hist.getInfo<CL_KERNEL_FUNCTION_NAME>(), hist_wait[0], image_bytes));
+		}
+
+		//the standard normalisation needs the first non-empty bin of the whole scan, so it always runs as its own stage
+		const bool cdf_norm = (options.norm_variant == "cdf");
+		const bool fuse_norm = options.fuse_norm && !cdf_norm;
+		EnqueueCumHist(context, queue, program, slot.int_histogram, slot.cum_histogram, options.bin_count, local_size, options.scan_variant,
+			resident ? &hist_wait : NULL, &scan_wait[0], fuse_norm ? &slot.norm_histogram : NULL, histogram_count, &profile, &slot.scan_block_sums, 0, &slot.scan_kernels);
+
+		kernel_norm.setArg(0, slot.cum_histogram);
+		kernel_norm.setArg(1, slot.norm_histogram);
+		if (cdf_norm) {
+			kernel_norm.setArg(2, options.bin_count);
+		}
+		else {
+			kernel_norm.setArg(2, histogram_count);
+			kernel_norm.setArg(3, options.bin_count);
+		}
+
+		if (fuse_norm)
+			norm_wait = scan_wait; //the look-up table was already written by the last scan stage
+		else {
+			queue.enqueueNDRangeKernel(kernel_norm, cl::NullRange, cl::NDRange((size_t)options.bin_count), cl::NullRange, resident ? &scan_wait : NULL, &norm_wait[0]);
+			profile.push_back(ProfiledEvent(cdf_norm ? "norm_hist_cdf" : "norm_hist", norm_wait[0], 2 * (size_t)options.bin_count * sizeof(int)));
+		}
+
+		if (image_path) {
+			kernel_output_image.setArg(0, slot.dev_image_2d);
+			kernel_output_image.setArg(1, slot.norm_histogram);
+			kernel_output_image.setArg(2, slot.dev_image_output);
+			queue.enqueueNDRangeKernel(kernel_output_image, cl::NullRange, image_global_2d, image_local_2d, resident ? &norm_wait : NULL, &slot.kernel_event);
+			profile.push_back(ProfiledEvent("back_project_image", slot.kernel_event, 2 * image_bytes));
+			EnqueueDownload(slot, image_input, output_image, resident, blocking_output);
+			return;
+		}
+
+		cl::Kernel& output = luma ? kernel_output_luma : kernel_output;
+		output.setArg(0, slot.dev_image_input);
+		output.setArg(1, slot.norm_histogram);
+		output.setArg(2, slot.dev_image_output);
+		if (luma) {
+			output.setArg(3, image_size);
+			output.setArg(4, options.bin_count);
+		}
+		else {
+			output.setArg(3, image_size);
+		}
+
+		queue.enqueueNDRangeKernel(output, cl::NullRange, cl::NDRange(vectorised ? vector_global_size : padded_image_size), cl::NDRange(image_local_size), resident ? &norm_wait : NULL, &slot.kernel_event);
+		profile.push_back(ProfiledEvent(output.getInfo<CL_KERNEL_FUNCTION_NAME>(), slot.kernel_event, 2 * image_bytes));
+		EnqueueDownload(slot, image_input, output_image, resident, blocking_output);
+	}
+
+	//enqueues the download of the equalised image in slot.dev_image_output into output_image once slot.kernel_event has completed
+	void EnqueueDownload(Slot& slot, const CImg<T>& image_input, CImg<T>& output_image, bool resident, bool blocking_output) {
+		cl::CommandQueue& queue = slot.queue;
+		vector<ProfiledEvent>& profile = slot.profile;
+		const size_t image_bytes = image_input.size() * sizeof(T);
+
+		vector<cl::Event> output_wait(1, slot.kernel_event);
+		cl_bool blocking = blocking_output ? CL_TRUE : CL_FALSE;
+		if (options.host_memory == "zerocopy") {
+			slot.mapped_output_ptr = (T*)queue.enqueueMapBuffer(slot.dev_image_output, blocking, CL_MAP_READ, 0, image_bytes, resident ? &output_wait : NULL, &slot.output_event);
+			output_image.assign(slot.mapped_output_ptr, image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), true);
+			profile.push_back(ProfiledEvent("map output", slot.output_event, image_bytes));
+		}
+		else if (options.host_memory == "pinned") {
+			queue.enqueueReadBuffer(slot.dev_image_output, blocking, 0, image_bytes, slot.pinned_output_ptr, resident ? &output_wait : NULL, &slot.output_event);
+			output_image.assign(slot.pinned_output_ptr, image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), true);
+			profile.push_back(ProfiledEvent("read output", slot.output_event, image_bytes));
+		}
+		else {
+			if (output_image.is_shared())
+				output_image.assign();
+			output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+			queue.enqueueReadBuffer(slot.dev_image_output, blocking, 0, image_bytes, output_image.data(), resident ? &output_wait : NULL, &slot.output_event);
+			profile.push_back(ProfiledEvent("read output", slot.output_event, image_bytes));
+		}
+	}
+
+	//2D range of the image object kernels over slot.dev_image_2d - work groups of image_local_size work items, 16 columns wide when that divides it
+	void ImageRange2D(const Slot& slot, cl::NDRange& global, cl::NDRange& local) const {
+		size_t columns = (image_local_size % 16 == 0) ? 16 : image_local_size;
+		size_t rows = image_local_size / columns;
+		global = cl::NDRange(RoundUp(slot.image_width, columns), RoundUp(slot.image_rows, rows));
+		local = cl::NDRange(columns, rows);
+	}
+
+	//enqueues the contrast limited adaptive equalisation of the image in slot.dev_image_input (or slot.dev_image_2d if image_path is set),
+	//setting slot.kernel_event to the last kernel
+	//the histograms of all the tiles are counted in one launch, then one work group per tile clips and scans its histogram into the tile's
+	//look-up table, and back-projection interpolates every pixel between the tables of the four nearest tiles - colour planes are equalised separately
+	void EnqueueClahe(Slot& slot, const CImg<T>& image_input, const vector<cl::Event>* wait_events, bool image_path) {
+		cl::CommandQueue& queue = slot.queue;
+		vector<ProfiledEvent>& profile = slot.profile;
+		const int width = image_input.width(), height = image_input.height() * image_input.depth();
+		const int tiles_x = std::min(options.clahe_tiles_x, width), tiles_y = std::min(options.clahe_tiles_y, height);
+		const int tile_count = tiles_x * tiles_y * image_input.spectrum();
+		const int pixel_count = image_input.size();
+		const int bin_size = options.bin_count;
+
+		size_t tile_bytes = tile_count * (size_t)options.bin_count * sizeof(int);
+		if (tile_bytes > slot.tile_capacity) {
+			slot.tile_histograms = cl::Buffer(context, CL_MEM_READ_WRITE, tile_bytes);
+			slot.tile_luts = cl::Buffer(context, CL_MEM_READ_WRITE, tile_bytes);
+			slot.tile_capacity = tile_bytes;
+		}
+
+		vector<cl::Event> clear_wait(1), hist_wait(1), clip_wait(1), lut_wait(1);
+		queue.enqueueFillBuffer(slot.tile_histograms, 0, 0, tile_bytes, wait_events, &clear_wait[0]);
+		profile.push_back(ProfiledEvent("clear tile histograms", clear_wait[0], tile_bytes));
+
+		cl::NDRange image_global_2d, image_local_2d;
+		if (image_path) {
+			ImageRange2D(slot, image_global_2d, image_local_2d);
+			kernel_tile_hist_image.setArg(0, slot.dev_image_2d);
+			kernel_tile_hist_image.setArg(1, slot.tile_histograms);
+			kernel_tile_hist_image.setArg(2, height);
+			kernel_tile_hist_image.setArg(3, tiles_x);
+			kernel_tile_hist_image.setArg(4, tiles_y);
+			kernel_tile_hist_image.setArg(5, bin_size);
+			queue.enqueueNDRangeKernel(kernel_tile_hist_image, cl::NullRange, image_global_2d, image_local_2d, &clear_wait, &hist_wait[0]);
+			profile.push_back(ProfiledEvent("tile_hist_image", hist_wait[0], pixel_count * sizeof(T)));
+		}
+		else {
+			kernel_tile_hist.setArg(0, slot.dev_image_input);
+			kernel_tile_hist.setArg(1, slot.tile_histograms);
+			kernel_tile_hist.setArg(2, width);
+			kernel_tile_hist.setArg(3, height);
+			kernel_tile_hist.setArg(4, tiles_x);
+			kernel_tile_hist.setArg(5, tiles_y);
+			kernel_tile_hist.setArg(6, bin_size);
+			kernel_tile_hist.setArg(7, pixel_count);
+			queue.enqueueNDRangeKernel(kernel_tile_hist, cl::NullRange, cl::NDRange(RoundUp(pixel_count, image_local_size)), cl::NDRange(image_local_size), &clear_wait, &hist_wait[0]);
+			profile.push_back(ProfiledEvent("tile_hist", hist_wait[0], pixel_count * sizeof(T)));
+		}
+
+		if (options.clip_limit > 0.0f) {
+			kernel_clip.setArg(0, slot.tile_histograms);
+			kernel_clip.setArg(1, cl::Local(tile_local_size * sizeof(int)));
+			kernel_clip.setArg(2, options.clip_limit);
+			kernel_clip.setArg(3, width);
+			kernel_clip.setArg(4, height);
+			kernel_clip.setArg(5, tiles_x);
+			kernel_clip.setArg(6, tiles_y);
+			kernel_clip.setArg(7, bin_size);
+			queue.enqueueNDRangeKernel(kernel_clip, cl::NullRange, cl::NDRange(tile_count * tile_local_size), cl::NDRange(tile_local_size), &hist_wait, &clip_wait[0]);
+			profile.push_back(ProfiledEvent("clip_hist", clip_wait[0], 2 * tile_bytes));
+		}
+		else {
+			clip_wait = hist_wait; //plain adaptive equalisation
+		}
+
+		kernel_tile_lut.setArg(0, slot.tile_histograms);
+		kernel_tile_lut.setArg(1, slot.tile_luts);
+		kernel_tile_lut.setArg(2, cl::Local(tile_local_size * sizeof(int)));
+		kernel_tile_lut.setArg(3, cl::Local(tile_local_size * sizeof(int)));
+		kernel_tile_lut.setArg(4, width);
+		kernel_tile_lut.setArg(5, height);
+		kernel_tile_lut.setArg(6, tiles_x);
+		kernel_tile_lut.setArg(7, tiles_y);
+		kernel_tile_lut.setArg(8, bin_size);
+		queue.enqueueNDRangeKernel(kernel_tile_lut, cl::NullRange, cl::NDRange(tile_count * tile_local_size), cl::NDRange(tile_local_size), &clip_wait, &lut_wait[0]);
+		profile.push_back(ProfiledEvent("tile_lut", lut_wait[0], 2 * tile_bytes));
+
+		if (image_path) {
+			kernel_output_clahe_image.setArg(0, slot.dev_image_2d);
+			kernel_output_clahe_image.setArg(1, slot.tile_luts);
+			kernel_output_clahe_image.setArg(2, slot.dev_image_output);
+			kernel_output_clahe_image.setArg(3, height);
+			kernel_output_clahe_image.setArg(4, tiles_x);
+			kernel_output_clahe_image.setArg(5, tiles_y);
+			kernel_output_clahe_image.setArg(6, bin_size);
+			queue.enqueueNDRangeKernel(kernel_output_clahe_image, cl::NullRange, image_global_2d, image_local_2d, &lut_wait, &slot.kernel_event);
+			profile.push_back(ProfiledEvent("back_project_clahe_image", slot.kernel_event, 2 * pixel_count * sizeof(T)));
+			return;
+		}
+
+		kernel_output_clahe.setArg(0, slot.dev_image_input);
+		kernel_output_clahe.setArg(1, slot.tile_luts);
+		kernel_output_clahe.setArg(2, slot.dev_image_output);
+		kernel_output_clahe.setArg(3, width);
+		kernel_output_clahe.setArg(4, height);
+		kernel_output_clahe.setArg(5, tiles_x);
+		kernel_output_clahe.setArg(6, tiles_y);
+		kernel_output_clahe.setArg(7, bin_size);
+		kernel_output_clahe.setArg(8, pixel_count);
+		queue.enqueueNDRangeKernel(kernel_output_clahe, cl::NullRange, cl::NDRange(RoundUp(pixel_count, image_local_size)), cl::NDRange(image_local_size), &lut_wait, &slot.kernel_event);
+		profile.push_back(ProfiledEvent("back_project_clahe", slot.kernel_event, 2 * pixel_count * sizeof(T)));
+	}
+
+	cl::Context context;
+	EqualisationOptions options;
+	cl::Program program;
+	bool program_from_cache;
+	size_t local_size; //work group size of the scans
+	size_t tile_local_size; //work group size of the per-tile kernels of adaptive equalisation
+	size_t image_local_size; //work group size of the kernels that run over the image
+	cl::ImageFormat image_format; //CL_R channel of the pixel type, for the image object path
+	size_t image_max_width;
+	size_t image_max_height;
+
+	cl::Kernel kernel_hist;
+	cl::Kernel kernel_hist_sampled; //approximate histogram
+	cl::Kernel kernel_norm;
+	cl::Kernel kernel_output;
+	cl::Kernel kernel_hist_luma; //colour images in luma mode
+	cl::Kernel kernel_output_luma;
+	cl::Kernel kernel_tile_hist; //adaptive equalisation
+	cl::Kernel kernel_clip;
+	cl::Kernel kernel_tile_lut;
+	cl::Kernel kernel_output_clahe;
+	cl::Kernel kernel_hist_image; //image object path
+	cl::Kernel kernel_output_image;
+	cl::Kernel kernel_tile_hist_image;
+	cl::Kernel kernel_output_clahe_image;
+
+	vector<Slot> slots;
+
+};
+
+typedef BasicEqualiser<unsigned char> Equaliser; //8-bit images
+typedef BasicEqualiser<unsigned short> Equaliser16; //16-bit images
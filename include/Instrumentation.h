@@ -0,0 +1,156 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "Utils.h"
+
+//work group limits and memory use of a kernel as compiled for a device
+struct KernelResources {
+	size_t work_group_size; //CL_KERNEL_WORK_GROUP_SIZE - largest work group the kernel can be launched with
+	size_t preferred_multiple; //CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE - SIMD width the work groups should be a multiple of
+	cl_ulong local_mem_size; //CL_KERNEL_LOCAL_MEM_SIZE - local memory of each work group, without the local arguments set at launch
+	cl_ulong private_mem_size; //CL_KERNEL_PRIVATE_MEM_SIZE - private memory of each work item, high values mean registers spilled to memory
+};
+
+KernelResources GetKernelResources(const cl::Kernel& kernel, const cl::Device& device) {
+	KernelResources resources;
+	resources.work_group_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	resources.preferred_multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+	resources.local_mem_size = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+	resources.private_mem_size = kernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
+	return resources;
+}
+
+//global memory bandwidth of a device in GB/s, which OpenCL doesn't report - the fastest of a few device to device copies of a buffer of
+//size bytes (each byte read once and written once), to compare the bandwidth the kernels achieve against
+double MeasurePeakBandwidth(const cl::Context& context, size_t size = 64 << 20) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size = std::min(size, (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) / sizeof(int) * sizeof(int);
+	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	cl::Buffer source(context, CL_MEM_READ_WRITE, size);
+	cl::Buffer destination(context, CL_MEM_READ_WRITE, size);
+	queue.enqueueFillBuffer(source, 0, 0, size); //the first touch of the buffers isn't timed
+
+	double peak_gbs = 0.0;
+	for (int i = 0; i < 5; i++) {
+		cl::Event event;
+		queue.enqueueCopyBuffer(source, destination, 0, 0, size, NULL, &event);
+		event.wait();
+		cl_ulong ns = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		if (ns > 0)
+			peak_gbs = std::max(peak_gbs, 2.0 * size / ns); //bytes per ns is GB/s
+	}
+	return peak_gbs;
+}
+
+//resources and achieved rates of one command of a profile
+struct CommandMetrics {
+	bool is_kernel;
+	KernelResources resources; //kernels only
+	double executed_us;
+	double gbs; //achieved bandwidth, 0 for commands without a byte count
+	double mpps; //pixels of the image over the execution time, in megapixels per second
+};
+
+//metrics of every command of a profile - kernels are looked up in program by the name they were profiled under,
+//and pixel_count is the size of the image the profile equalised
+vector<CommandMetrics> GetCommandMetrics(const vector<ProfiledEvent>& events, const cl::Program& program, const cl::Device& device, size_t pixel_count) {
+	map<string, KernelResources> kernel_resources; //every kernel is only queried once
+	vector<CommandMetrics> metrics(events.size());
+	for (size_t i = 0; i < events.size(); i++) {
+		const cl::Event& evnt = events[i].event;
+		cl_ulong ns = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		CommandMetrics& command = metrics[i];
+		command.is_kernel = (evnt.getInfo<CL_EVENT_COMMAND_TYPE>() == CL_COMMAND_NDRANGE_KERNEL);
+		command.executed_us = ns / 1000.0;
+		command.gbs = (ns > 0) ? (double)events[i].bytes / ns : 0.0;
+		command.mpps = (ns > 0) ? pixel_count * 1000.0 / ns : 0.0;
+
+		if (command.is_kernel) {
+			map<string, KernelResources>::iterator found = kernel_resources.find(events[i].name);
+			if (found == kernel_resources.end())
+				found = kernel_resources.insert(make_pair(events[i].name, GetKernelResources(cl::Kernel(program, events[i].name.c_str()), device))).first;
+			command.resources = found->second;
+		}
+	}
+	return metrics;
+}
+
+//table of the metrics of every command, with the bandwidth as a percentage of peak_gbs
+string GetInstrumentationReport(const vector<ProfiledEvent>& events, const vector<CommandMetrics>& metrics, double peak_gbs) {
+	stringstream sstream;
+	sstream << left << setw(28) << "Stage" << right << setw(12) << "Exec [us]" << setw(10) << "GB/s" << setw(8) << "% peak" << setw(10) << "MP/s"
+		<< setw(8) << "WG max" << setw(8) << "SIMD" << setw(10) << "Local [B]" << setw(12) << "Private [B]" << endl;
+	for (size_t i = 0; i < events.size(); i++) {
+		const CommandMetrics& command = metrics[i];
+		sstream << left << setw(28) << events[i].name << right << fixed << setprecision(1) << setw(12) << command.executed_us;
+		if (events[i].bytes > 0)
+			sstream << setw(10) << command.gbs << setw(8) << ((peak_gbs > 0.0) ? 100.0 * command.gbs / peak_gbs : 0.0);
+		else
+			sstream << setw(10) << "-" << setw(8) << "-";
+		sstream << setw(10) << command.mpps;
+		if (command.is_kernel)
+			sstream << setw(8) << command.resources.work_group_size << setw(8) << command.resources.preferred_multiple
+				<< setw(10) << command.resources.local_mem_size << setw(12) << command.resources.private_mem_size;
+		sstream << endl;
+	}
+	sstream << "Peak bandwidth " << peak_gbs << " GB/s" << endl;
+	sstream.unsetf(ios::floatfield);
+
+	return sstream.str();
+}
+
+//text with the characters that end or escape a JSON string escaped
+string JsonEscape(const string& text) {
+	string escaped;
+	for (size_t i = 0; i < text.size(); i++) {
+		if ((text[i] == '"') || (text[i] == '\\'))
+			escaped += '\\';
+		escaped += text[i];
+	}
+	return escaped;
+}
+
+//the profile in the Chrome trace event format, for chrome://tracing or Perfetto - one complete event per command over its execution,
+//in us from the first command being queued, on one track per command queue, with the wait before execution, the bandwidth and the
+//kernel resources as arguments
+string GetChromeTrace(const vector<ProfiledEvent>& events, const vector<CommandMetrics>& metrics, const string& device_name, double peak_gbs) {
+	cl_ulong first_queued = 0;
+	for (size_t i = 0; i < events.size(); i++) {
+		cl_ulong queued = events[i].event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		if ((i == 0) || (queued < first_queued))
+			first_queued = queued;
+	}
+
+	stringstream sstream;
+	sstream << fixed << setprecision(3);
+	sstream << "{\n  \"displayTimeUnit\": \"ns\",\n  \"traceEvents\": [";
+	sstream << "\n    {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"" << JsonEscape(device_name) << "\"}}";
+
+	map<cl_command_queue, int> tracks; //a track per queue, so that the slots of the batch mode show side by side
+	for (size_t i = 0; i < events.size(); i++) {
+		const cl::Event& evnt = events[i].event;
+		cl_command_queue queue = evnt.getInfo<CL_EVENT_COMMAND_QUEUE>()();
+		if (tracks.find(queue) == tracks.end()) {
+			int track = (int)tracks.size();
+			tracks[queue] = track;
+			sstream << ",\n    {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << track << ", \"args\": {\"name\": \"queue " << track << "\"}}";
+		}
+
+		cl_ulong queued = evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(), submit = evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		cl_ulong start = evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>(), end = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		const CommandMetrics& command = metrics[i];
+		sstream << ",\n    {\"name\": \"" << JsonEscape(events[i].name) << "\", \"cat\": \"" << (command.is_kernel ? "kernel" : "command") << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << tracks[queue]
+			<< ", \"ts\": " << (start - first_queued) / 1000.0 << ", \"dur\": " << (end - start) / 1000.0
+			<< ", \"args\": {\"queued_us\": " << (submit - queued) / 1000.0 << ", \"submitted_us\": " << (start - submit) / 1000.0 << ", \"bytes\": " << events[i].bytes
+			<< ", \"gbs\": " << command.gbs << ", \"peak_percent\": " << ((peak_gbs > 0.0) ? 100.0 * command.gbs / peak_gbs : 0.0) << ", \"mpps\": " << command.mpps;
+		if (command.is_kernel)
+			sstream << ", \"work_group_size\": " << command.resources.work_group_size << ", \"preferred_multiple\": " << command.resources.preferred_multiple
+				<< ", \"local_mem_bytes\": " << command.resources.local_mem_size << ", \"private_mem_bytes\": " << command.resources.private_mem_size;
+		sstream << "}}";
+	}
+	sstream << "\n  ]\n}\n";
+
+	return sstream.str();
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+
+using namespace cimg_library;
+
+//equalises 8-bit images across several devices, each with its own context so that devices of different platforms can be mixed
+//the image is split into bands of rows, every device counts the histogram of its own band, the partial histograms are summed on the host,
+//the first device turns the sum into the look-up table and every device then maps its own band with that shared table
+//bands are sized in proportion to each device's throughput - estimated from its compute units and clock for the first image
+//and measured on every image after that, so that all the devices finish at about the same time; a device that hasn't been measured yet
+//(it got no rows) is given the pixels per us its compute units and clock are worth on the devices that have been
+//the bands cut across the colour planes, so colour images are only equalised as one flat channel (options.colour_mode "flat") and refused under
+//"luma"; the histogram kernel and pixels per work item are those of BasicEqualiser, chosen for each device, and adaptive and sampled
+//equalisation are refused
+class MultiDeviceEqualiser {
+public:
+	MultiDeviceEqualiser(const vector<cl::Device>& devices, const EqualisationOptions& options) :
+		options(options), H(options.bin_count), lut(options.bin_count) {
+		CheckBinCount<unsigned char>(options.bin_count);
+		if ((options.clahe_tiles_x > 0) || (options.sample_rate > 1))
+			throw CImgArgumentException("The multi-device mode doesn't support adaptive equalisation or sampled histograms");
+		string build_options = string("-DPIXEL_TYPE=") + PixelType<unsigned char>::Name();
+		const bool vectorised = (options.pixels_per_item >= 16);
+
+		for (size_t i = 0; i < devices.size(); i++) {
+			Node node;
+			node.device = devices[i];
+			node.context = cl::Context({ devices[i] });
+			node.queue = cl::CommandQueue(node.context, CL_QUEUE_PROFILING_ENABLE);
+			node.program = BuildProgram(node.context, "kernels/my_kernels.cl", build_options, options.use_program_cache);
+
+			//a privatised histogram of every bin has to fit in the device's local memory, as in BasicEqualiser
+			node.hist_local = (options.hist_variant == "local");
+			if (node.hist_local && ((size_t)options.bin_count * sizeof(int) > devices[i].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())) {
+				std::cerr << "WARNING: " << options.bin_count << " bins do not fit in the local memory of " << devices[i].getInfo<CL_DEVICE_NAME>()
+					<< ", using the atomic histogram kernel" << std::endl;
+				node.hist_local = false;
+			}
+			node.kernel_hist = cl::Kernel(node.program, node.hist_local ? "int_hist_local" : (vectorised ? "int_hist_vec" : "int_hist"));
+			node.kernel_norm = cl::Kernel(node.program, "norm_hist_cdf");
+			node.kernel_output = cl::Kernel(node.program, vectorised ? "back_project_vec" : "back_project");
+			node.local_size = ImageWorkGroupSize(node.device, vector<cl::Kernel>({ node.kernel_hist, node.kernel_output }), options.work_group_size);
+			node.scan_local_size = ScanWorkGroupSize(node.device, node.program, options.bin_count);
+			node.histogram = cl::Buffer(node.context, CL_MEM_READ_WRITE, H.size() * sizeof(int));
+			node.cum_histogram = cl::Buffer(node.context, CL_MEM_READ_WRITE, H.size() * sizeof(int));
+			node.lut = cl::Buffer(node.context, CL_MEM_READ_WRITE, H.size() * sizeof(int)); //written by the scan on the first device, uploaded on the others
+			node.partial_histogram.resize(H.size());
+			node.estimate = double(devices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) * devices[i].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+			nodes.push_back(node);
+		}
+	}
+
+	//equalises input into output, which is resized to match the input
+	void Equalise(const CImg<unsigned char>& image_input, CImg<unsigned char>& output_image) {
+		const int row_size = image_input.width();
+		const int row_count = image_input.height() * image_input.depth() * image_input.spectrum(); //rows of every plane, one after another
+		if ((image_input.spectrum() == 3) && (options.colour_mode == "luma"))
+			throw CImgArgumentException("The multi-device mode only equalises colour images as one flat channel - use '-colour flat'");
+		output_image.assign(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+
+		//bands in proportion to the throughput of each device - measured devices by their pixels per us, the others by their compute units
+		//and clock converted to pixels per us at the rate of the measured ones, so that every weight is in the same unit
+		double measured_throughput = 0.0, measured_estimate = 0.0;
+		for (size_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].throughput > 0.0) {
+				measured_throughput += nodes[i].throughput;
+				measured_estimate += nodes[i].estimate;
+			}
+		}
+		vector<double> weights(nodes.size());
+		double total_weight = 0.0;
+		for (size_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].throughput > 0.0)
+				weights[i] = nodes[i].throughput;
+			else
+				weights[i] = (measured_estimate > 0.0) ? nodes[i].estimate * measured_throughput / measured_estimate : nodes[i].estimate;
+			total_weight += weights[i];
+		}
+		int row = 0;
+		for (size_t i = 0; i < nodes.size(); i++) {
+			Node& node = nodes[i];
+			int rows = (i + 1 == nodes.size()) ? row_count - row : int(row_count * weights[i] / total_weight + 0.5);
+			node.first_row = row;
+			node.rows = std::min(rows, row_count - row);
+			row += node.rows;
+			node.profile.clear();
+			node.band_profile.clear();
+		}
+
+		//1 - every device counts the histogram of its band, all devices at the same time
+		for (size_t i = 0; i < nodes.size(); i++) {
+			Node& node = nodes[i];
+			if (node.rows == 0)
+				continue;
+
+			int pixel_count = node.rows * row_size;
+			if ((size_t)pixel_count > node.image_capacity) {
+				node.image_input = cl::Buffer(node.context, CL_MEM_READ_ONLY, pixel_count);
+				node.image_output = cl::Buffer(node.context, CL_MEM_WRITE_ONLY, pixel_count);
+				node.image_capacity = pixel_count;
+			}
+
+			cl::Event event;
+			node.queue.enqueueFillBuffer(node.histogram, 0, 0, H.size() * sizeof(int), NULL, &event);
+			node.profile.push_back(ProfiledEvent("clear histogram", event));
+			node.queue.enqueueWriteBuffer(node.image_input, CL_FALSE, 0, pixel_count, image_input.data() + (size_t)node.first_row * row_size, NULL, &event);
+			node.profile.push_back(ProfiledEvent("upload band", event));
+			node.band_profile.push_back(node.profile.back());
+
+			node.kernel_hist.setArg(0, node.image_input);
+			node.kernel_hist.setArg(1, node.histogram);
+			if (node.hist_local) {
+				node.kernel_hist.setArg(2, cl::Local(H.size() * sizeof(int)));
+				node.kernel_hist.setArg(3, int(H.size()));
+				node.kernel_hist.setArg(4, pixel_count);
+			}
+			else {
+				node.kernel_hist.setArg(2, pixel_count);
+			}
+			size_t hist_global_size = node.hist_local ? RoundUp(pixel_count, node.local_size) : BandGlobalSize(pixel_count, node.local_size);
+			node.queue.enqueueNDRangeKernel(node.kernel_hist, cl::NullRange, cl::NDRange(hist_global_size), cl::NDRange(node.local_size), NULL, &event);
+			node.profile.push_back(ProfiledEvent(node.kernel_hist.getInfo<CL_KERNEL_FUNCTION_NAME>(), event));
+			node.band_profile.push_back(node.profile.back());
+
+			node.queue.enqueueReadBuffer(node.histogram, CL_FALSE, 0, H.size() * sizeof(int), &node.partial_histogram[0], NULL, &event);
+			node.profile.push_back(ProfiledEvent("read partial histogram", event));
+			node.queue.flush();
+		}
+
+		std::fill(H.begin(), H.end(), 0);
+		for (size_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].rows == 0)
+				continue;
+			nodes[i].queue.finish();
+			for (size_t j = 0; j < H.size(); j++)
+				H[j] += nodes[i].partial_histogram[j];
+		}
+
+		//2 - the first device scans the summed histogram into the shared look-up table
+		Node& lut_node = nodes[0];
+		//the standard normalisation needs the first non-empty bin of the whole scan, so it runs as its own stage
+		const bool cdf_norm = (options.norm_variant == "cdf");
+		lut_node.queue.enqueueWriteBuffer(lut_node.histogram, CL_FALSE, 0, H.size() * sizeof(int), &H[0]);
+		EnqueueCumHist(lut_node.context, lut_node.queue, lut_node.program, lut_node.histogram, lut_node.cum_histogram, int(H.size()), lut_node.scan_local_size, options.scan_variant,
+			NULL, NULL, cdf_norm ? NULL : &lut_node.lut, (int)image_input.size(), &lut_node.profile, &lut_node.scan_block_sums, 0, &lut_node.scan_kernels);
+		if (cdf_norm) {
+			cl::Event event;
+			lut_node.kernel_norm.setArg(0, lut_node.cum_histogram);
+			lut_node.kernel_norm.setArg(1, lut_node.lut);
+			lut_node.kernel_norm.setArg(2, int(H.size()));
+			lut_node.queue.enqueueNDRangeKernel(lut_node.kernel_norm, cl::NullRange, cl::NDRange(H.size()), cl::NullRange, NULL, &event);
+			lut_node.profile.push_back(ProfiledEvent("norm_hist_cdf", event));
+		}
+		lut_node.queue.enqueueReadBuffer(lut_node.lut, CL_TRUE, 0, H.size() * sizeof(int), &lut[0]);
+
+		//3 - every device maps its own band with the shared table
+		for (size_t i = 0; i < nodes.size(); i++) {
+			Node& node = nodes[i];
+			if (node.rows == 0)
+				continue;
+
+			int pixel_count = node.rows * row_size;
+			cl::Event event;
+			if (i > 0) {
+				node.queue.enqueueWriteBuffer(node.lut, CL_FALSE, 0, H.size() * sizeof(int), &lut[0], NULL, &event);
+				node.profile.push_back(ProfiledEvent("upload look-up table", event));
+			}
+
+			node.kernel_output.setArg(0, node.image_input);
+			node.kernel_output.setArg(1, node.lut);
+			node.kernel_output.setArg(2, node.image_output);
+			node.kernel_output.setArg(3, pixel_count);
+			node.queue.enqueueNDRangeKernel(node.kernel_output, cl::NullRange, cl::NDRange(BandGlobalSize(pixel_count, node.local_size)), cl::NDRange(node.local_size), NULL, &event);
+			node.profile.push_back(ProfiledEvent(node.kernel_output.getInfo<CL_KERNEL_FUNCTION_NAME>(), event));
+			node.band_profile.push_back(node.profile.back());
+
+			node.queue.enqueueReadBuffer(node.image_output, CL_FALSE, 0, pixel_count, output_image.data() + (size_t)node.first_row * row_size, NULL, &event);
+			node.profile.push_back(ProfiledEvent("read band", event));
+			node.band_profile.push_back(node.profile.back());
+			node.queue.flush();
+		}
+
+		//the measured throughput of each device sizes its band of the next image - only the commands of its own band are timed, so that the
+		//look-up table the first device makes for all of them doesn't count against it
+		for (size_t i = 0; i < nodes.size(); i++) {
+			Node& node = nodes[i];
+			if (node.rows == 0)
+				continue;
+			node.queue.finish();
+			double time = DeviceTime(node.band_profile);
+			if (time > 0.0)
+				node.throughput = node.rows * double(row_size) / time;
+		}
+	}
+
+	int DeviceCount() const { return (int)nodes.size(); }
+	string DeviceName(int device) const { return nodes[device].device.getInfo<CL_DEVICE_NAME>(); }
+
+	//rows of the last image equalised on a device, and the events of every command it ran for it
+	int BandRows(int device) const { return nodes[device].rows; }
+	const vector<ProfiledEvent>& Profile(int device) const { return nodes[device].profile; }
+
+private:
+	//global size of the per-pixel kernels over a band of pixel_count pixels - one work item per pixel, or per options.pixels_per_item pixels
+	//for the vector kernels, rounded up to whole work groups of local_size
+	size_t BandGlobalSize(int pixel_count, size_t local_size) const {
+		if (options.pixels_per_item < 16)
+			return RoundUp(pixel_count, local_size);
+		size_t item_count = ((size_t)pixel_count + options.pixels_per_item - 1) / options.pixels_per_item;
+		return RoundUp(std::max(item_count, (size_t)1), local_size);
+	}
+
+	//context, queue, program and buffers of one device
+	struct Node {
+		Node() : hist_local(false), local_size(0), scan_local_size(0), image_capacity(0), first_row(0), rows(0), estimate(0.0), throughput(0.0) {}
+
+		cl::Device device;
+		cl::Context context;
+		cl::CommandQueue queue;
+		cl::Program program;
+		bool hist_local; //int_hist_local, if the bins fit in the device's local memory
+		cl::Kernel kernel_hist;
+		cl::Kernel kernel_norm; //norm_hist_cdf, the scale normalisation is fused with the scan
+		cl::Kernel kernel_output;
+		size_t local_size;
+		size_t scan_local_size;
+
+		size_t image_capacity; //size of the band buffers in bytes
+		cl::Buffer image_input;
+		cl::Buffer image_output;
+		cl::Buffer histogram;
+		cl::Buffer cum_histogram;
+		cl::Buffer lut;
+		vector<cl::Buffer> scan_block_sums; //block totals of the hierarchical scans
+		ScanKernels scan_kernels;
+		vector<int> partial_histogram;
+
+		int first_row;
+		int rows;
+		double estimate; //compute units times clock in MHz, until the device has been measured
+		double throughput; //pixels per us measured on the last image it got rows of, 0 before that
+		vector<ProfiledEvent> profile;
+		vector<ProfiledEvent> band_profile; //upload, histogram, back_project and read of its own band, which time its throughput
+	};
+
+	EqualisationOptions options;
+	vector<Node> nodes;
+	vector<int> H; //summed histogram
+	vector<int> lut; //shared look-up table
+};
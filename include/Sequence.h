@@ -0,0 +1,182 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+
+using namespace cimg_library;
+
+//equalises the 8-bit frames of a video or camera stream one after another, keeping the frame, histogram and look-up table on the device between frames
+//with options.delta_bands set, the frame is split into that many bands of rows and only the bands that differ from the previous frame are
+//uploaded, with hist_delta moving their changed pixels between bins instead of the whole histogram being counted again
+//the look-up table of every frame is blended into an exponential moving average (options.lut_smoothing) so that the brightness doesn't flicker
+//colour frames are equalised as one flat channel, and a frame of a different size starts the sequence again
+class SequenceEqualiser {
+public:
+	SequenceEqualiser(const cl::Context& context, const EqualisationOptions& options) :
+		context(context), options(options), frame_capacity(0), changed_bands(0), restart(true) {
+		CheckBinCount<unsigned char>(options.bin_count);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		queue = cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE);
+		program = BuildProgram(context, "kernels/my_kernels.cl", string("-DPIXEL_TYPE=") + PixelType<unsigned char>::Name(), options.use_program_cache);
+		kernel_hist = cl::Kernel(program, "int_hist");
+		kernel_delta = cl::Kernel(program, "hist_delta");
+		kernel_norm = cl::Kernel(program, "norm_hist_cdf");
+		kernel_smooth = cl::Kernel(program, "smooth_lut");
+		kernel_output = cl::Kernel(program, "back_project");
+		local_size = ImageWorkGroupSize(device, vector<cl::Kernel>({ kernel_hist, kernel_delta, kernel_output }), options.work_group_size);
+		scan_local_size = ScanWorkGroupSize(device, program, options.bin_count);
+
+		size_t lut_bytes = options.bin_count * sizeof(int);
+		histogram = cl::Buffer(context, CL_MEM_READ_WRITE, lut_bytes);
+		cum_histogram = cl::Buffer(context, CL_MEM_READ_WRITE, lut_bytes);
+		frame_lut = cl::Buffer(context, CL_MEM_READ_WRITE, lut_bytes);
+		average_lut = cl::Buffer(context, CL_MEM_READ_WRITE, options.bin_count * sizeof(float));
+		lut = cl::Buffer(context, CL_MEM_READ_WRITE, lut_bytes);
+	}
+
+	//equalises the next frame of the sequence into output_image, which is resized to match the frame
+	void Equalise(const CImg<unsigned char>& frame, CImg<unsigned char>& output_image) {
+		const size_t pixel_count = frame.size();
+		const int row_size = frame.width();
+		const int row_count = frame.height() * frame.depth() * frame.spectrum();
+		output_image.assign(frame.width(), frame.height(), frame.depth(), frame.spectrum());
+		profile.clear();
+
+		if (pixel_count > frame_capacity) {
+			frame_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, pixel_count);
+			update_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, pixel_count);
+			output_buffer = cl::Buffer(context, CL_MEM_WRITE_ONLY, pixel_count);
+			frame_capacity = pixel_count;
+		}
+		vector<int> shape({ frame.width(), frame.height(), frame.depth(), frame.spectrum() });
+		if (shape != frame_shape)
+			restart = true;
+		frame_shape = shape;
+
+		cl::Event event;
+		if (restart || (options.delta_bands <= 0)) {
+			//the whole frame is uploaded and its histogram counted from scratch
+			queue.enqueueFillBuffer(histogram, 0, 0, options.bin_count * sizeof(int), NULL, &event);
+			profile.push_back(ProfiledEvent("clear histogram", event));
+			queue.enqueueWriteBuffer(frame_buffer, CL_FALSE, 0, pixel_count, frame.data(), NULL, &event);
+			profile.push_back(ProfiledEvent("upload frame", event));
+
+			kernel_hist.setArg(0, frame_buffer);
+			kernel_hist.setArg(1, histogram);
+			kernel_hist.setArg(2, (int)pixel_count);
+			queue.enqueueNDRangeKernel(kernel_hist, cl::NullRange, cl::NDRange(RoundUp(pixel_count, local_size)), cl::NDRange(local_size), NULL, &event);
+			profile.push_back(ProfiledEvent("int_hist", event));
+			changed_bands = std::max(options.delta_bands, 1);
+		}
+		else {
+			//only runs of bands that differ from the previous frame are uploaded and moved between bins
+			int band_count = std::min(options.delta_bands, row_count);
+			changed_bands = 0;
+			int run_start = -1; //first band of the current run of changed bands
+			for (int band = 0; band <= band_count; band++) {
+				size_t start = (size_t)(band * (long long)row_count / band_count) * row_size;
+				bool changed = false;
+				if (band < band_count) {
+					size_t end = (size_t)((band + 1) * (long long)row_count / band_count) * row_size;
+					changed = (memcmp(frame.data() + start, previous_frame.data() + start, end - start) != 0);
+					changed_bands += changed ? 1 : 0;
+				}
+
+				if (changed && (run_start < 0)) {
+					run_start = band;
+				}
+				else if (!changed && (run_start >= 0)) {
+					size_t run_offset = (size_t)(run_start * (long long)row_count / band_count) * row_size;
+					int run_pixels = (int)(start - run_offset);
+					queue.enqueueWriteBuffer(update_buffer, CL_FALSE, run_offset, run_pixels, frame.data() + run_offset, NULL, &event);
+					profile.push_back(ProfiledEvent("upload changed bands", event));
+
+					kernel_delta.setArg(0, update_buffer);
+					kernel_delta.setArg(1, frame_buffer);
+					kernel_delta.setArg(2, histogram);
+					kernel_delta.setArg(3, (int)run_offset);
+					kernel_delta.setArg(4, run_pixels);
+					queue.enqueueNDRangeKernel(kernel_delta, cl::NullRange, cl::NDRange(RoundUp(run_pixels, local_size)), cl::NDRange(local_size), NULL, &event);
+					profile.push_back(ProfiledEvent("hist_delta", event));
+					run_start = -1;
+				}
+			}
+		}
+		if (options.delta_bands > 0)
+			previous_frame = frame; //host copy the next frame is compared with
+
+		//the standard normalisation needs the first non-empty bin of the whole scan, so it runs as its own stage
+		const bool cdf_norm = (options.norm_variant == "cdf");
+		EnqueueCumHist(context, queue, program, histogram, cum_histogram, options.bin_count, scan_local_size, options.scan_variant,
+			NULL, NULL, cdf_norm ? NULL : &frame_lut, (int)pixel_count, &profile, &scan_block_sums, 0, &scan_kernels);
+		if (cdf_norm) {
+			kernel_norm.setArg(0, cum_histogram);
+			kernel_norm.setArg(1, frame_lut);
+			kernel_norm.setArg(2, options.bin_count);
+			queue.enqueueNDRangeKernel(kernel_norm, cl::NullRange, cl::NDRange(options.bin_count), cl::NullRange, NULL, &event);
+			profile.push_back(ProfiledEvent("norm_hist_cdf", event));
+		}
+
+		//the first frame of a sequence starts the moving average at its own table
+		kernel_smooth.setArg(0, frame_lut);
+		kernel_smooth.setArg(1, average_lut);
+		kernel_smooth.setArg(2, lut);
+		kernel_smooth.setArg(3, restart ? 1.0f : options.lut_smoothing);
+		queue.enqueueNDRangeKernel(kernel_smooth, cl::NullRange, cl::NDRange(options.bin_count), cl::NullRange, NULL, &event);
+		profile.push_back(ProfiledEvent("smooth_lut", event));
+
+		kernel_output.setArg(0, frame_buffer);
+		kernel_output.setArg(1, lut);
+		kernel_output.setArg(2, output_buffer);
+		kernel_output.setArg(3, (int)pixel_count);
+		queue.enqueueNDRangeKernel(kernel_output, cl::NullRange, cl::NDRange(RoundUp(pixel_count, local_size)), cl::NDRange(local_size), NULL, &event);
+		profile.push_back(ProfiledEvent("back_project", event));
+
+		queue.enqueueReadBuffer(output_buffer, CL_TRUE, 0, pixel_count, output_image.data(), NULL, &event);
+		profile.push_back(ProfiledEvent("download frame", event));
+		restart = false;
+	}
+
+	//the next frame is counted from scratch and starts a new moving average, e.g. after a scene cut
+	void Restart() { restart = true; }
+
+	//bands of the last frame that differed from the frame before (every band when it was counted from scratch)
+	int ChangedBands() const { return changed_bands; }
+
+	const vector<ProfiledEvent>& Profile() const { return profile; }
+
+private:
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Program program;
+	cl::Kernel kernel_hist;
+	cl::Kernel kernel_delta;
+	cl::Kernel kernel_norm; //norm_hist_cdf, the scale normalisation is fused with the scan
+	cl::Kernel kernel_smooth;
+	cl::Kernel kernel_output;
+	EqualisationOptions options;
+	size_t local_size;
+	size_t scan_local_size;
+
+	size_t frame_capacity; //size of the frame buffers in bytes
+	cl::Buffer frame_buffer; //the last frame, updated in place by hist_delta
+	cl::Buffer update_buffer; //changed bands of the new frame
+	cl::Buffer output_buffer;
+	cl::Buffer histogram; //histogram of the last frame, kept between frames
+	cl::Buffer cum_histogram;
+	vector<cl::Buffer> scan_block_sums; //block totals of the hierarchical scans
+	ScanKernels scan_kernels;
+	cl::Buffer frame_lut; //look-up table of the last frame alone
+	cl::Buffer average_lut; //moving average of the look-up tables, in float
+	cl::Buffer lut; //rounded moving average used by back_project
+
+	vector<int> frame_shape; //width, height, depth and spectrum of the last frame
+	CImg<unsigned char> previous_frame;
+	int changed_bands;
+	bool restart;
+	vector<ProfiledEvent> profile;
+};
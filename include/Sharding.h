@@ -0,0 +1,222 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+
+using namespace cimg_library;
+
+//histogram of part of a dataset, summed over the images of one worker's shard - the bins are 64-bit so that millions of images don't overflow them
+struct PartialHistogram {
+	PartialHistogram(int bin_count = 256) : bins(bin_count, 0), pixel_count(0), image_count(0) {}
+
+	vector<unsigned long long> bins;
+	unsigned long long pixel_count;
+	unsigned long long image_count;
+};
+
+//little-endian integers of the partial histogram and look-up table files, so that nodes of any byte order can exchange them
+void WriteLittleEndian(ostream& out, unsigned long long value, int bytes) {
+	for (int i = 0; i < bytes; i++)
+		out.put((char)((value >> (8 * i)) & 0xff));
+}
+
+unsigned long long ReadLittleEndian(istream& in, int bytes) {
+	unsigned long long value = 0;
+	for (int i = 0; i < bytes; i++)
+		value |= (unsigned long long)(unsigned char)in.get() << (8 * i);
+	return value;
+}
+
+//partial histogram file - "EQPH", version (4 bytes), bin count (4 bytes), image count and pixel count (8 bytes each), then every bin (8 bytes each)
+void SavePartialHistogram(const string& file_name, const PartialHistogram& partial) {
+	ofstream file(file_name.c_str(), ios::binary);
+	file.write("EQPH", 4);
+	WriteLittleEndian(file, 1, 4);
+	WriteLittleEndian(file, partial.bins.size(), 4);
+	WriteLittleEndian(file, partial.image_count, 8);
+	WriteLittleEndian(file, partial.pixel_count, 8);
+	for (size_t i = 0; i < partial.bins.size(); i++)
+		WriteLittleEndian(file, partial.bins[i], 8);
+	if (!file)
+		throw CImgIOException("Cannot write partial histogram '%s'", file_name.c_str());
+}
+
+PartialHistogram LoadPartialHistogram(const string& file_name) {
+	ifstream file(file_name.c_str(), ios::binary);
+	char magic[4] = { 0 };
+	file.read(magic, 4);
+	if (!file || (memcmp(magic, "EQPH", 4) != 0) || (ReadLittleEndian(file, 4) != 1))
+		throw CImgIOException("'%s' is not a partial histogram", file_name.c_str());
+
+	unsigned long long bin_count = ReadLittleEndian(file, 4);
+	if ((bin_count == 0) || (bin_count > 65536))
+		throw CImgIOException("Invalid bin count in partial histogram '%s'", file_name.c_str());
+	PartialHistogram partial((int)bin_count);
+	partial.image_count = ReadLittleEndian(file, 8);
+	partial.pixel_count = ReadLittleEndian(file, 8);
+	for (size_t i = 0; i < partial.bins.size(); i++)
+		partial.bins[i] = ReadLittleEndian(file, 8);
+	if (!file)
+		throw CImgIOException("Truncated partial histogram '%s'", file_name.c_str());
+	return partial;
+}
+
+//adds the histogram of another shard into total, which must have the same number of bins
+void AddPartialHistogram(PartialHistogram& total, const PartialHistogram& partial) {
+	if (partial.bins.size() != total.bins.size())
+		throw CImgArgumentException("Partial histograms with %u and %u bins can't be merged", (unsigned int)partial.bins.size(), (unsigned int)total.bins.size());
+	for (size_t i = 0; i < total.bins.size(); i++)
+		total.bins[i] += partial.bins[i];
+	total.pixel_count += partial.pixel_count;
+	total.image_count += partial.image_count;
+}
+
+//look-up table file - "EQLT", version (4 bytes), bin count (4 bytes), then every entry (4 bytes each)
+void SaveLut(const string& file_name, const vector<int>& lut) {
+	ofstream file(file_name.c_str(), ios::binary);
+	file.write("EQLT", 4);
+	WriteLittleEndian(file, 1, 4);
+	WriteLittleEndian(file, lut.size(), 4);
+	for (size_t i = 0; i < lut.size(); i++)
+		WriteLittleEndian(file, (unsigned int)lut[i], 4);
+	if (!file)
+		throw CImgIOException("Cannot write look-up table '%s'", file_name.c_str());
+}
+
+vector<int> LoadLut(const string& file_name) {
+	ifstream file(file_name.c_str(), ios::binary);
+	char magic[4] = { 0 };
+	file.read(magic, 4);
+	if (!file || (memcmp(magic, "EQLT", 4) != 0) || (ReadLittleEndian(file, 4) != 1))
+		throw CImgIOException("'%s' is not a look-up table", file_name.c_str());
+
+	unsigned long long bin_count = ReadLittleEndian(file, 4);
+	if ((bin_count == 0) || (bin_count > 65536))
+		throw CImgIOException("Invalid bin count in look-up table '%s'", file_name.c_str());
+	vector<int> lut((size_t)bin_count);
+	for (size_t i = 0; i < lut.size(); i++)
+		lut[i] = (int)ReadLittleEndian(file, 4);
+	if (!file)
+		throw CImgIOException("Truncated look-up table '%s'", file_name.c_str());
+	return lut;
+}
+
+//look-up table of the histogram of a whole dataset (see HostLookUpTable) - pixel_max is the largest pixel value
+vector<int> DatasetLut(const PartialHistogram& histogram, const string& norm_variant, int pixel_max) {
+	return HostLookUpTable(histogram.bins, norm_variant, pixel_max);
+}
+
+//one worker of the sharded mode for 8-bit images - the first pass counts each image of its shard with int_hist on the device and adds
+//the counts into a 64-bit partial histogram, and once the reducer has shared the dataset look-up table the second pass maps each image with it
+//colour images are counted and mapped as one flat channel (as '-colour flat'), so that every image of the dataset shares the one table
+class ShardWorker {
+public:
+	ShardWorker(const cl::Context& context, const EqualisationOptions& options) :
+		context(context), options(options), partial(options.bin_count), host_histogram(options.bin_count), image_capacity(0) {
+		CheckBinCount<unsigned char>(options.bin_count);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		queue = cl::CommandQueue(context, CL_QUEUE_PROFILING_ENABLE);
+		program = BuildProgram(context, "kernels/my_kernels.cl", string("-DPIXEL_TYPE=") + PixelType<unsigned char>::Name(), options.use_program_cache);
+		kernel_hist = cl::Kernel(program, "int_hist");
+		kernel_output = cl::Kernel(program, "back_project");
+		local_size = ImageWorkGroupSize(device, vector<cl::Kernel>({ kernel_hist, kernel_output }), options.work_group_size);
+
+		histogram = cl::Buffer(context, CL_MEM_READ_WRITE, options.bin_count * sizeof(int));
+		lut = cl::Buffer(context, CL_MEM_READ_ONLY, options.bin_count * sizeof(int));
+	}
+
+	//pass 1 - adds the histogram of image to the partial histogram
+	void AddImage(const CImg<unsigned char>& image) {
+		const int pixel_count = Reserve(image);
+		profile.clear();
+
+		cl::Event event;
+		queue.enqueueFillBuffer(histogram, 0, 0, options.bin_count * sizeof(int), NULL, &event);
+		profile.push_back(ProfiledEvent("clear histogram", event, options.bin_count * sizeof(int)));
+		queue.enqueueWriteBuffer(image_input, CL_FALSE, 0, pixel_count, image.data(), NULL, &event);
+		profile.push_back(ProfiledEvent("upload input", event, pixel_count));
+
+		kernel_hist.setArg(0, image_input);
+		kernel_hist.setArg(1, histogram);
+		kernel_hist.setArg(2, pixel_count);
+		queue.enqueueNDRangeKernel(kernel_hist, cl::NullRange, cl::NDRange(RoundUp(pixel_count, local_size)), cl::NDRange(local_size), NULL, &event);
+		profile.push_back(ProfiledEvent("int_hist", event, pixel_count));
+
+		queue.enqueueReadBuffer(histogram, CL_TRUE, 0, options.bin_count * sizeof(int), &host_histogram[0], NULL, &event);
+		profile.push_back(ProfiledEvent("read histogram", event, options.bin_count * sizeof(int)));
+
+		for (size_t bin = 0; bin < host_histogram.size(); bin++)
+			partial.bins[bin] += (unsigned int)host_histogram[bin];
+		partial.pixel_count += pixel_count;
+		partial.image_count++;
+	}
+
+	//histogram of every image added so far
+	const PartialHistogram& Partial() const { return partial; }
+
+	//pass 2 - sets the dataset look-up table that Apply maps the images with, which must have options.bin_count entries
+	void SetLut(const vector<int>& dataset_lut) {
+		if (dataset_lut.size() != (size_t)options.bin_count)
+			throw CImgArgumentException("The look-up table has %u entries, not %d", (unsigned int)dataset_lut.size(), options.bin_count);
+		queue.enqueueWriteBuffer(lut, CL_TRUE, 0, dataset_lut.size() * sizeof(int), &dataset_lut[0]);
+	}
+
+	//maps image with the dataset look-up table into output_image, which is resized to match
+	void Apply(const CImg<unsigned char>& image, CImg<unsigned char>& output_image) {
+		const int pixel_count = Reserve(image);
+		output_image.assign(image.width(), image.height(), image.depth(), image.spectrum());
+		profile.clear();
+
+		cl::Event event;
+		queue.enqueueWriteBuffer(image_input, CL_FALSE, 0, pixel_count, image.data(), NULL, &event);
+		profile.push_back(ProfiledEvent("upload input", event, pixel_count));
+
+		kernel_output.setArg(0, image_input);
+		kernel_output.setArg(1, lut);
+		kernel_output.setArg(2, image_output);
+		kernel_output.setArg(3, pixel_count);
+		queue.enqueueNDRangeKernel(kernel_output, cl::NullRange, cl::NDRange(RoundUp(pixel_count, local_size)), cl::NDRange(local_size), NULL, &event);
+		profile.push_back(ProfiledEvent("back_project", event, 2 * (size_t)pixel_count));
+
+		queue.enqueueReadBuffer(image_output, CL_TRUE, 0, pixel_count, output_image.data(), NULL, &event);
+		profile.push_back(ProfiledEvent("read output", event, pixel_count));
+	}
+
+	//events of the last image added or applied
+	const vector<ProfiledEvent>& Profile() const { return profile; }
+
+private:
+	//grows the image buffers to fit image and returns its number of pixels
+	int Reserve(const CImg<unsigned char>& image) {
+		if (image.size() > 0x7fffffff)
+			throw CImgArgumentException("Images of the sharded mode must have fewer than 2^31 pixels");
+		if (image.size() > image_capacity) {
+			image_input = cl::Buffer(context, CL_MEM_READ_ONLY, image.size());
+			image_output = cl::Buffer(context, CL_MEM_WRITE_ONLY, image.size());
+			image_capacity = image.size();
+		}
+		return (int)image.size();
+	}
+
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Program program;
+	cl::Kernel kernel_hist;
+	cl::Kernel kernel_output;
+	EqualisationOptions options;
+	size_t local_size;
+
+	PartialHistogram partial;
+	vector<int> host_histogram; //histogram of the last image, read back from the device
+	size_t image_capacity; //size of the image buffers in bytes
+	cl::Buffer image_input;
+	cl::Buffer image_output;
+	cl::Buffer histogram;
+	cl::Buffer lut;
+	vector<ProfiledEvent> profile;
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX //keep windows.h from defining min and max macros
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace cimg_library;
+
+//memory mapping of a whole file, so that images larger than host memory are paged in and out by the operating system
+class MappedFile {
+public:
+	//maps an existing file for reading, or if size is not 0 creates (or truncates) the file with size bytes and maps it for writing
+	MappedFile(const string& file_name, size_t size = 0) : data(NULL), size(size) {
+		bool write = (size > 0);
+#ifdef _WIN32
+		mapping = NULL;
+		file = CreateFileA(file_name.c_str(), write ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, NULL,
+			write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			throw CImgIOException("Cannot open '%s'", file_name.c_str());
+
+		LARGE_INTEGER file_size;
+		file_size.QuadPart = (LONGLONG)size;
+		if (!write && GetFileSizeEx(file, &file_size))
+			this->size = (size_t)file_size.QuadPart;
+
+		if (this->size > 0)
+			mapping = CreateFileMappingA(file, NULL, write ? PAGE_READWRITE : PAGE_READONLY, file_size.HighPart, file_size.LowPart, NULL);
+		if (mapping != NULL)
+			data = (unsigned char*)MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+#else
+		file = open(file_name.c_str(), write ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+		if (file < 0)
+			throw CImgIOException("Cannot open '%s'", file_name.c_str());
+
+		struct stat file_stat;
+		if (write) {
+			if (ftruncate(file, (off_t)size) != 0)
+				this->size = 0;
+		}
+		else if (fstat(file, &file_stat) == 0) {
+			this->size = (size_t)file_stat.st_size;
+		}
+
+		if (this->size > 0) {
+			void* mapped = mmap(NULL, this->size, write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, file, 0);
+			data = (mapped != MAP_FAILED) ? (unsigned char*)mapped : NULL;
+		}
+#endif
+		if (data == NULL) {
+			Close();
+			throw CImgIOException("Cannot map '%s'", file_name.c_str());
+		}
+	}
+
+	~MappedFile() { Close(); }
+
+	unsigned char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	MappedFile(const MappedFile&); //the mapping is owned by exactly one object
+	MappedFile& operator=(const MappedFile&);
+
+	void Close() {
+#ifdef _WIN32
+		if (data != NULL)
+			UnmapViewOfFile(data);
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != NULL)
+			munmap(data, size);
+		if (file >= 0)
+			close(file);
+		file = -1;
+#endif
+		data = NULL;
+	}
+
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+	unsigned char* data;
+	size_t size;
+};
+
+//dimensions of a binary (P5) PGM image and the offset of its raster in the file
+struct PgmHeader {
+	int width;
+	int height;
+	int max_value;
+	size_t data_offset;
+};
+
+//parses the header of a binary PGM file held in memory - comment lines are skipped and exactly one whitespace character ends the header
+PgmHeader ParsePgmHeader(const unsigned char* data, size_t size) {
+	if ((size < 2) || (data[0] != 'P') || (data[1] != '5'))
+		throw CImgIOException("Only binary (P5) PGM images can be streamed");
+
+	int values[3]; //width, height and maximum value
+	size_t pos = 2;
+	for (int i = 0; i < 3; i++) {
+		while ((pos < size) && (isspace(data[pos]) || (data[pos] == '#'))) {
+			if (data[pos] == '#') { //comment up to the end of the line
+				while ((pos < size) && (data[pos] != '\n'))
+					pos++;
+			}
+			else {
+				pos++;
+			}
+		}
+		if ((pos >= size) || !isdigit(data[pos]))
+			throw CImgIOException("Invalid PGM header");
+		long long value = 0;
+		while ((pos < size) && isdigit(data[pos]) && (value < 0x7fffffff))
+			value = value * 10 + (data[pos++] - '0');
+		values[i] = (int)value;
+	}
+
+	PgmHeader header;
+	header.width = values[0];
+	header.height = values[1];
+	header.max_value = values[2];
+	header.data_offset = pos + 1; //the single whitespace character after the maximum value
+	if ((header.width <= 0) || (header.height <= 0) || (header.data_offset + (size_t)header.width * header.height > size))
+		throw CImgIOException("Invalid or truncated PGM image");
+
+	return header;
+}
+
+//reads the 32-bit device histogram back into counts and adds it into the 64-bit histogram H
+void AddDeviceHistogram(const cl::CommandQueue& queue, const cl::Buffer& histogram, vector<int>& counts, vector<unsigned long long>& H, vector<ProfiledEvent>& profile) {
+	cl::Event event;
+	queue.enqueueReadBuffer(histogram, CL_TRUE, 0, counts.size() * sizeof(int), &counts[0], NULL, &event);
+	profile.push_back(ProfiledEvent("read histogram", event));
+	for (size_t bin = 0; bin < H.size(); bin++)
+		H[bin] += (unsigned int)counts[bin];
+}
+
+//equalises an 8-bit binary PGM file that may be larger than host or device memory into output_file_name, without loading either image
+//the input raster is memory mapped and uploaded chunk_size pixels at a time, with int_hist counting every chunk into the device histogram,
+//which is added into a 64-bit host histogram before its 32-bit bins could overflow, so that images of any size are counted exactly
+//the look-up table is scanned and normalised from the 64-bit histogram on the host (HostLookUpTable) and uploaded, and a second pass maps
+//each chunk with back_project straight into the memory mapped output
+//uploads, kernels and downloads go to three queues chained through events, and two chunk buffers alternate, so that the upload of one chunk
+//overlaps the kernel of the previous one and the download of the one before that
+//returns the profile of every command enqueued
+vector<ProfiledEvent> StreamEqualise(const cl::Context& context, const EqualisationOptions& options, const string& input_file_name, const string& output_file_name, size_t chunk_size) {
+	CheckBinCount<unsigned char>(options.bin_count);
+	MappedFile input_file(input_file_name);
+	PgmHeader header = ParsePgmHeader(input_file.Data(), input_file.Size());
+	if (header.max_value > 255)
+		throw CImgIOException("Only 8-bit PGM images can be streamed");
+	const unsigned long long pixel_count = (unsigned long long)header.width * header.height;
+	const unsigned char* input_raster = input_file.Data() + header.data_offset;
+
+	//the output has the same dimensions, written to a mapped file of the final size
+	stringstream output_header;
+	output_header << "P5\n" << header.width << " " << header.height << "\n255\n";
+	MappedFile output_file(output_file_name, output_header.str().size() + (size_t)pixel_count);
+	memcpy(output_file.Data(), output_header.str().c_str(), output_header.str().size());
+	unsigned char* output_raster = output_file.Data() + output_header.str().size();
+
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::CommandQueue upload_queue(context, CL_QUEUE_PROFILING_ENABLE);
+	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE); //kernels, and the histogram and look-up table transfers between them
+	cl::CommandQueue download_queue(context, CL_QUEUE_PROFILING_ENABLE);
+	cl::Program program = BuildProgram(context, "kernels/my_kernels.cl", string("-DPIXEL_TYPE=") + PixelType<unsigned char>::Name(), options.use_program_cache);
+	cl::Kernel kernel_hist(program, "int_hist");
+	cl::Kernel kernel_output(program, "back_project");
+	size_t local_size = ImageWorkGroupSize(device, vector<cl::Kernel>({ kernel_hist, kernel_output }), options.work_group_size);
+
+	//chunks are limited by the largest buffer the device can allocate, and by the int pixel count of the kernels
+	chunk_size = std::min(chunk_size, (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+	chunk_size = std::min(chunk_size, (size_t)0x7fffffff);
+	chunk_size = std::max((size_t)std::min((unsigned long long)chunk_size, pixel_count), (size_t)1);
+	cl::Buffer chunk_input[2] = { cl::Buffer(context, CL_MEM_READ_ONLY, chunk_size), cl::Buffer(context, CL_MEM_READ_ONLY, chunk_size) };
+	cl::Buffer chunk_output[2] = { cl::Buffer(context, CL_MEM_WRITE_ONLY, chunk_size), cl::Buffer(context, CL_MEM_WRITE_ONLY, chunk_size) };
+	cl::Buffer histogram(context, CL_MEM_READ_WRITE, options.bin_count * sizeof(int));
+	cl::Buffer lut(context, CL_MEM_READ_ONLY, options.bin_count * sizeof(int));
+
+	vector<ProfiledEvent> profile;
+	vector<cl::Event> input_free[2]; //kernel that last read each chunk input buffer, which the next upload into it waits for
+	vector<cl::Event> output_free[2]; //download that last read each chunk output buffer, which the next kernel writing it waits for
+	vector<int> chunk_histogram(options.bin_count);
+	vector<unsigned long long> H(options.bin_count, 0); //histogram of the whole image
+	unsigned long long counted = 0; //pixels counted into the device histogram since it was last added into H
+	cl::Event event;
+
+	//pass 1 - histogram of every chunk, accumulated on the device and added into H whenever the next chunk could overflow a bin
+	size_t chunk = 0;
+	for (unsigned long long offset = 0; offset < pixel_count; offset += chunk_size, chunk++) {
+		int chunk_pixels = (int)std::min((unsigned long long)chunk_size, pixel_count - offset);
+		if ((chunk == 0) || (counted + chunk_pixels > 0x7fffffffULL)) {
+			if (counted > 0)
+				AddDeviceHistogram(queue, histogram, chunk_histogram, H, profile);
+			queue.enqueueFillBuffer(histogram, 0, 0, options.bin_count * sizeof(int), NULL, &event);
+			profile.push_back(ProfiledEvent("clear histogram", event));
+			counted = 0;
+		}
+
+		vector<cl::Event> upload_wait(1);
+		upload_queue.enqueueWriteBuffer(chunk_input[chunk % 2], CL_FALSE, 0, chunk_pixels, input_raster + offset, input_free[chunk % 2].empty() ? NULL : &input_free[chunk % 2], &upload_wait[0]);
+		profile.push_back(ProfiledEvent("upload chunk", upload_wait[0]));
+
+		kernel_hist.setArg(0, chunk_input[chunk % 2]);
+		kernel_hist.setArg(1, histogram);
+		kernel_hist.setArg(2, chunk_pixels);
+		queue.enqueueNDRangeKernel(kernel_hist, cl::NullRange, cl::NDRange(RoundUp(chunk_pixels, local_size)), cl::NDRange(local_size), &upload_wait, &event);
+		profile.push_back(ProfiledEvent("int_hist", event));
+		input_free[chunk % 2].assign(1, event);
+		counted += chunk_pixels;
+		upload_queue.flush();
+		queue.flush();
+	}
+
+	AddDeviceHistogram(queue, histogram, chunk_histogram, H, profile);
+	vector<int> host_lut = HostLookUpTable(H, options.norm_variant, 255);
+	queue.enqueueWriteBuffer(lut, CL_FALSE, 0, options.bin_count * sizeof(int), &host_lut[0], NULL, &event);
+	profile.push_back(ProfiledEvent("upload look-up table", event));
+
+	//pass 2 - every chunk is uploaded again, mapped and written straight into the output mapping
+	chunk = 0;
+	for (unsigned long long offset = 0; offset < pixel_count; offset += chunk_size, chunk++) {
+		int chunk_pixels = (int)std::min((unsigned long long)chunk_size, pixel_count - offset);
+		vector<cl::Event> kernel_wait(1);
+		upload_queue.enqueueWriteBuffer(chunk_input[chunk % 2], CL_FALSE, 0, chunk_pixels, input_raster + offset, input_free[chunk % 2].empty() ? NULL : &input_free[chunk % 2], &kernel_wait[0]);
+		profile.push_back(ProfiledEvent("upload chunk", kernel_wait[0]));
+
+		kernel_output.setArg(0, chunk_input[chunk % 2]);
+		kernel_output.setArg(1, lut);
+		kernel_output.setArg(2, chunk_output[chunk % 2]);
+		kernel_output.setArg(3, chunk_pixels);
+		kernel_wait.insert(kernel_wait.end(), output_free[chunk % 2].begin(), output_free[chunk % 2].end());
+		queue.enqueueNDRangeKernel(kernel_output, cl::NullRange, cl::NDRange(RoundUp(chunk_pixels, local_size)), cl::NDRange(local_size), &kernel_wait, &event);
+		profile.push_back(ProfiledEvent("back_project", event));
+		input_free[chunk % 2].assign(1, event);
+
+		vector<cl::Event> download_wait(1, event);
+		output_free[chunk % 2].resize(1);
+		download_queue.enqueueReadBuffer(chunk_output[chunk % 2], CL_FALSE, 0, chunk_pixels, output_raster + offset, &download_wait, &output_free[chunk % 2][0]);
+		profile.push_back(ProfiledEvent("read chunk", output_free[chunk % 2][0]));
+		upload_queue.flush();
+		queue.flush();
+		download_queue.flush();
+	}
+
+	download_queue.finish(); //every read has landed in the output mapping before it is unmapped
+	queue.finish();
+	upload_queue.finish();
+	return profile;
+}
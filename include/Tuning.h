@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "Utils.h"
+#include "CImg.h"
+#include "Equalisation.h"
+
+using namespace cimg_library;
+
+//key of a device's entry in the tuning profile - the best settings depend on the device and on the number of bins
+string DeviceProfileKey(int platform_id, int device_id, int bin_count) {
+	stringstream key;
+	key << GetDeviceName(platform_id, device_id) << "|" << bin_count;
+	return key.str();
+}
+
+//reads the settings tuned for key from the profile file into options, returns false if the file has no entry for it
+//each line of the file is the key, a tab and then the work group size, pixels per work item, histogram kernel and scan
+bool LoadDeviceProfile(const string& file_name, const string& key, EqualisationOptions& options) {
+	ifstream file(file_name.c_str());
+	string line;
+
+	while (getline(file, line)) {
+		size_t tab = line.find('\t');
+		if ((tab == string::npos) || (line.compare(0, tab, key) != 0))
+			continue;
+
+		istringstream settings(line.substr(tab + 1));
+		EqualisationOptions tuned = options;
+		if (settings >> tuned.work_group_size >> tuned.pixels_per_item >> tuned.hist_variant >> tuned.scan_variant) {
+			options = tuned;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//stores the tuned settings of options under key in the profile file, replacing any earlier entry for the same key
+void SaveDeviceProfile(const string& file_name, const string& key, const EqualisationOptions& options) {
+	vector<string> lines;
+	ifstream in_file(file_name.c_str());
+	string line;
+	while (getline(in_file, line)) {
+		if (!line.empty() && (line.compare(0, line.find('\t'), key) != 0))
+			lines.push_back(line);
+	}
+	in_file.close();
+
+	stringstream entry;
+	entry << key << "\t" << options.work_group_size << " " << options.pixels_per_item << " " << options.hist_variant << " " << options.scan_variant;
+	lines.push_back(entry.str());
+
+	ofstream out_file(file_name.c_str());
+	for (size_t i = 0; i < lines.size(); i++)
+		out_file << lines[i] << endl;
+	if (!out_file)
+		throw CImgIOException("Cannot write tuning profile '%s'", file_name.c_str());
+}
+
+//times every combination of work group size, pixels per work item, histogram kernel and scan on image and returns options set to the fastest
+//each configuration is run once untimed and then iterations times, and configurations are compared on their median device time
+//work group sizes are the powers of two from 16 up to CL_DEVICE_MAX_WORK_GROUP_SIZE (at most 1024), the other settings are kept from options
+//T is the pixel type of image, which options.bin_count must cover
+template <typename T>
+EqualisationOptions AutoTune(const cl::Context& context, const EqualisationOptions& options, const CImg<T>& image, int iterations = 5) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size_t max_work_group_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
+	vector<size_t> work_group_sizes;
+	for (size_t size = 16; (size <= max_work_group_size) && (size <= 1024); size *= 2)
+		work_group_sizes.push_back(size);
+	if (work_group_sizes.empty())
+		work_group_sizes.push_back(max_work_group_size);
+	const int pixels_per_item[] = { 1, 16, 64 };
+	const char* hist_variants[] = { "atomic", "local" };
+	const char* scan_variants[] = { "hs", "blelloch" };
+
+	EqualisationOptions best = options;
+	double best_time = -1.0;
+	CImg<T> output_image;
+
+	std::cout << right << setw(6) << "WG" << setw(6) << "PPI" << setw(8) << "Hist" << setw(10) << "Scan" << setw(14) << "Median [us]" << std::endl;
+	for (size_t w = 0; w < work_group_sizes.size(); w++) {
+		for (int p = 0; p < 3; p++) {
+			for (int h = 0; h < 2; h++) {
+				for (int s = 0; s < 2; s++) {
+					EqualisationOptions candidate = options;
+					candidate.work_group_size = work_group_sizes[w];
+					candidate.pixels_per_item = pixels_per_item[p];
+					candidate.hist_variant = hist_variants[h];
+					candidate.scan_variant = scan_variants[s];
+
+					std::cout << setw(6) << candidate.work_group_size << setw(6) << candidate.pixels_per_item << setw(8) << candidate.hist_variant << setw(10) << candidate.scan_variant;
+					try {
+						BasicEqualiser<T> equaliser(context, candidate);
+						if (equaliser.WorkGroupSize() != candidate.work_group_size) { //limited by what the kernels support, so the same as a smaller size
+							std::cout << setw(14) << "-" << std::endl;
+							continue;
+						}
+
+						equaliser.Equalise(image, output_image); //warmup
+						vector<double> times;
+						for (int i = 0; i < std::max(iterations, 1); i++) {
+							equaliser.Equalise(image, output_image);
+							times.push_back(DeviceTime(equaliser.Profile()));
+						}
+						sort(times.begin(), times.end());
+						double median = times[times.size() / 2];
+						std::cout << setw(14) << median << std::endl;
+
+						if ((best_time < 0.0) || (median < best_time)) {
+							best = candidate;
+							best_time = median;
+						}
+					}
+					catch (const cl::Error& err) {
+						std::cout << "  failed: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+					}
+				}
+			}
+		}
+	}
+
+	return best;
+}
@@ -1,225 +1,505 @@
-#pragma once
-
-#include <fstream>
-#include <vector>
-#include <iostream>
-#include <sstream>
-
-#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
-#define CL_HPP_MINIMUM_OPENCL_VERSION 120
-#define CL_HPP_TARGET_OPENCL_VERSION 120
-#define CL_HPP_ENABLE_EXCEPTIONS
-
-#include <CL/cl2.hpp>
-
-using namespace std;
-
-template <typename T>
-ostream& operator<< (ostream& out, const vector<T>& v) {
-	if (!v.empty()) {
-		out << '[';
-		copy(v.begin(), v.end(), ostream_iterator<T>(out, ", "));
-		out << "\b\b]";
-	}
-	return out;
-}
-
-string GetPlatformName(int platform_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	return platforms[platform_id].getInfo<CL_PLATFORM_NAME>();
-}
-
-string GetDeviceName(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	vector<cl::Device> devices;
-	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-	return devices[device_id].getInfo<CL_DEVICE_NAME>();
-}
-
-const char *getErrorString(cl_int error) {
-	switch (error){
-		// run-time and JIT compiler errors
-	case 0: return "CL_SUCCESS";
-	case -1: return "CL_DEVICE_NOT_FOUND";
-	case -2: return "CL_DEVICE_NOT_AVAILABLE";
-	case -3: return "CL_COMPILER_NOT_AVAILABLE";
-	case -4: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
-	case -5: return "CL_OUT_OF_RESOURCES";
-	case -6: return "CL_OUT_OF_HOST_MEMORY";
-	case -7: return "CL_PROFILING_INFO_NOT_AVAILABLE";
-	case -8: return "CL_MEM_COPY_OVERLAP";
-	case -9: return "CL_IMAGE_FORMAT_MISMATCH";
-	case -10: return "CL_IMAGE_FORMAT_NOT_SUPPORTED";
-	case -11: return "CL_BUILD_PROGRAM_FAILURE";
-	case -12: return "CL_MAP_FAILURE";
-	case -13: return "CL_MISALIGNED_SUB_BUFFER_OFFSET";
-	case -14: return "CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST";
-	case -15: return "CL_COMPILE_PROGRAM_FAILURE";
-	case -16: return "CL_LINKER_NOT_AVAILABLE";
-	case -17: return "CL_LINK_PROGRAM_FAILURE";
-	case -18: return "CL_DEVICE_PARTITION_FAILED";
-	case -19: return "CL_KERNEL_ARG_INFO_NOT_AVAILABLE";
-
-		// compile-time errors
-	case -30: return "CL_INVALID_VALUE";
-	case -31: return "CL_INVALID_DEVICE_TYPE";
-	case -32: return "CL_INVALID_PLATFORM";
-	case -33: return "CL_INVALID_DEVICE";
-	case -34: return "CL_INVALID_CONTEXT";
-	case -35: return "CL_INVALID_QUEUE_PROPERTIES";
-	case -36: return "CL_INVALID_COMMAND_QUEUE";
-	case -37: return "CL_INVALID_HOST_PTR";
-	case -38: return "CL_INVALID_MEM_OBJECT";
-	case -39: return "CL_INVALID_IMAGE_FORMAT_DESCRIPTOR";
-	case -40: return "CL_INVALID_IMAGE_SIZE";
-	case -41: return "CL_INVALID_SAMPLER";
-	case -42: return "CL_INVALID_BINARY";
-	case -43: return "CL_INVALID_BUILD_OPTIONS";
-	case -44: return "CL_INVALID_PROGRAM";
-	case -45: return "CL_INVALID_PROGRAM_EXECUTABLE";
-	case -46: return "CL_INVALID_KERNEL_NAME";
-	case -47: return "CL_INVALID_KERNEL_DEFINITION";
-	case -48: return "CL_INVALID_KERNEL";
-	case -49: return "CL_INVALID_ARG_INDEX";
-	case -50: return "CL_INVALID_ARG_VALUE";
-	case -51: return "CL_INVALID_ARG_SIZE";
-	case -52: return "CL_INVALID_KERNEL_ARGS";
-	case -53: return "CL_INVALID_WORK_DIMENSION";
-	case -54: return "CL_INVALID_WORK_GROUP_SIZE";
-	case -55: return "CL_INVALID_WORK_ITEM_SIZE";
-	case -56: return "CL_INVALID_GLOBAL_OFFSET";
-	case -57: return "CL_INVALID_EVENT_WAIT_LIST";
-	case -58: return "CL_INVALID_EVENT";
-	case -59: return "CL_INVALID_OPERATION";
-	case -60: return "CL_INVALID_GL_OBJECT";
-	case -61: return "CL_INVALID_BUFFER_SIZE";
-	case -62: return "CL_INVALID_MIP_LEVEL";
-	case -63: return "CL_INVALID_GLOBAL_WORK_SIZE";
-	case -64: return "CL_INVALID_PROPERTY";
-	case -65: return "CL_INVALID_IMAGE_DESCRIPTOR";
-	case -66: return "CL_INVALID_COMPILER_OPTIONS";
-	case -67: return "CL_INVALID_LINKER_OPTIONS";
-	case -68: return "CL_INVALID_DEVICE_PARTITION_COUNT";
-
-		// extension errors
-	case -1000: return "CL_INVALID_GL_SHAREGROUP_REFERENCE_KHR";
-	case -1001: return "CL_PLATFORM_NOT_FOUND_KHR";
-	case -1002: return "CL_INVALID_D3D10_DEVICE_KHR";
-	case -1003: return "CL_INVALID_D3D10_RESOURCE_KHR";
-	case -1004: return "CL_D3D10_RESOURCE_ALREADY_ACQUIRED_KHR";
-	case -1005: return "CL_D3D10_RESOURCE_NOT_ACQUIRED_KHR";
-	default: return "Unknown OpenCL error";
-	}
-}
-
-void CheckError(cl_int error) {
-	if (error != CL_SUCCESS) {
-		cerr << "OpenCL call failed with error " << getErrorString(error) << endl;
-		exit(1);
-	}
-}
-
-void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
-	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
-}
-
-string ListPlatformsDevices() {
-
-	stringstream sstream;
-	vector<cl::Platform> platforms;
-
-	cl::Platform::get(&platforms);
-
-	sstream << "Found " << platforms.size() << " platform(s):" << endl;
-
-	for (unsigned int i = 0; i < platforms.size(); i++)
-	{
-		sstream << "\nPlatform " << i << ", " << platforms[i].getInfo<CL_PLATFORM_NAME>() << ", version: " << platforms[i].getInfo<CL_PLATFORM_VERSION>();
-
-		sstream << ", vendor: " << platforms[i].getInfo<CL_PLATFORM_VENDOR>() << endl;
-		//		sstream << ", extensions: " << platforms[i].getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
-
-		vector<cl::Device> devices;
-
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-
-		sstream << "\n   Found " << devices.size() << " device(s):" << endl;
-
-		for (unsigned int j = 0; j < devices.size(); j++)
-		{
-			sstream << "\n      Device " << j << ", " << devices[j].getInfo<CL_DEVICE_NAME>() << ", version: " << devices[j].getInfo<CL_DEVICE_VERSION>();
-
-			sstream << ", vendor: " << devices[j].getInfo<CL_DEVICE_VENDOR>();
-			cl_device_type device_type = devices[j].getInfo<CL_DEVICE_TYPE>();
-			sstream << ", type: ";
-			if (device_type & CL_DEVICE_TYPE_DEFAULT)
-				sstream << "DEFAULT ";
-			if (device_type & CL_DEVICE_TYPE_CPU)
-				sstream << "CPU ";
-			if (device_type & CL_DEVICE_TYPE_GPU)
-				sstream << "GPU ";
-			if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
-				sstream << "ACCELERATOR ";
-			sstream << ", compute units: " << devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-			sstream << ", clock freq [MHz]: " << devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
-			sstream << ", max memory size [B]: " << devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-			sstream << ", max allocatable memory [B]: " << devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
-
-			sstream << endl;
-		}
-	}
-	sstream << "----------------------------------------------------------------" << endl;
-
-	return sstream.str();
-}
-
-cl::Context GetContext(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-
-	cl::Platform::get(&platforms);
-
-	for (unsigned int i = 0; i < platforms.size(); i++)
-	{
-		vector<cl::Device> devices;
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-
-		for (unsigned int j = 0; j < devices.size(); j++)
-		{
-			if ((i == platform_id) && (j == device_id))
-				return cl::Context({ devices[j] });
-		}
-	}
-
-	return cl::Context();
-}
-
-enum ProfilingResolution {
-	PROF_NS = 1,
-	PROF_US = 1000,
-	PROF_MS = 1000000,
-	PROF_S = 1000000000
-};
-
-string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution) {
-	stringstream sstream;
-
-	sstream << "Queued " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
-	sstream << ", Submitted " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()) / resolution;
-	sstream << ", Executed " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / resolution;
-	sstream << ", Total " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
-
-	switch (resolution) {
-	case PROF_NS: sstream << " [ns]"; break;
-	case PROF_US: sstream << " [us]"; break;
-	case PROF_MS: sstream << " [ms]"; break;
-	case PROF_S: sstream << " [s]"; break;
-	default: break;
-	}
-
-	return sstream.str();
+#pragma once
+
+#include <fstream>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_ENABLE_EXCEPTIONS
+
+#include <CL/cl2.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX //keep windows.h from defining min and max macros
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+template <typename T>
+ostream& operator<< (ostream& out, const vector<T>& v) {
+	if (!v.empty()) {
+		out << '[';
+		copy(v.begin(), v.end(), ostream_iterator<T>(out, ", "));
+		out << "\b\b]";
+	}
+	return out;
+}
+
+//largest resident set (working set on Windows) of this process so far in bytes, 0 if it can't be read
+size_t PeakResidentMemory() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss; //bytes on macOS
+#else
+	return (size_t)usage.ru_maxrss * 1024; //kilobytes on Linux
+#endif
+#endif
+}
+
+string GetPlatformName(int platform_id) {
+	vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	return platforms[platform_id].getInfo<CL_PLATFORM_NAME>();
+}
+
+string GetDeviceName(int platform_id, int device_id) {
+	vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	vector<cl::Device> devices;
+	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+	return devices[device_id].getInfo<CL_DEVICE_NAME>();
+}
+
+const char *getErrorString(cl_int error) {
+	switch (error){
+		// run-time and JIT compiler errors
+	case 0: return "CL_SUCCESS";
+	case -1: return "CL_DEVICE_NOT_FOUND";
+	case -2: return "CL_DEVICE_NOT_AVAILABLE";
+	case -3: return "CL_COMPILER_NOT_AVAILABLE";
+	case -4: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
+	case -5: return "CL_OUT_OF_RESOURCES";
+	case -6: return "CL_OUT_OF_HOST_MEMORY";
+	case -7: return "CL_PROFILING_INFO_NOT_AVAILABLE";
+	case -8: return "CL_MEM_COPY_OVERLAP";
+	case -9: return "CL_IMAGE_FORMAT_MISMATCH";
+	case -10: return "CL_IMAGE_FORMAT_NOT_SUPPORTED";
+	case -11: return "CL_BUILD_PROGRAM_FAILURE";
+	case -12: return "CL_MAP_FAILURE";
+	case -13: return "CL_MISALIGNED_SUB_BUFFER_OFFSET";
+	case -14: return "CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST";
+	case -15: return "CL_COMPILE_PROGRAM_FAILURE";
+	case -16: return "CL_LINKER_NOT_AVAILABLE";
+	case -17: return "CL_LINK_PROGRAM_FAILURE";
+	case -18: return "CL_DEVICE_PARTITION_FAILED";
+	case -19: return "CL_KERNEL_ARG_INFO_NOT_AVAILABLE";
+
+		// compile-time errors
+	case -30: return "CL_INVALID_VALUE";
+	case -31: return "CL_INVALID_DEVICE_TYPE";
+	case -32: return "CL_INVALID_PLATFORM";
+	case -33: return "CL_INVALID_DEVICE";
+	case -34: return "CL_INVALID_CONTEXT";
+	case -35: return "CL_INVALID_QUEUE_PROPERTIES";
+	case -36: return "CL_INVALID_COMMAND_QUEUE";
+	case -37: return "CL_INVALID_HOST_PTR";
+	case -38: return "CL_INVALID_MEM_OBJECT";
+	case -39: return "CL_INVALID_IMAGE_FORMAT_DESCRIPTOR";
+	case -40: return "CL_INVALID_IMAGE_SIZE";
+	case -41: return "CL_INVALID_SAMPLER";
+	case -42: return "CL_INVALID_BINARY";
+	case -43: return "CL_INVALID_BUILD_OPTIONS";
+	case -44: return "CL_INVALID_PROGRAM";
+	case -45: return "CL_INVALID_PROGRAM_EXECUTABLE";
+	case -46: return "CL_INVALID_KERNEL_NAME";
+	case -47: return "CL_INVALID_KERNEL_DEFINITION";
+	case -48: return "CL_INVALID_KERNEL";
+	case -49: return "CL_INVALID_ARG_INDEX";
+	case -50: return "CL_INVALID_ARG_VALUE";
+	case -51: return "CL_INVALID_ARG_SIZE";
+	case -52: return "CL_INVALID_KERNEL_ARGS";
+	case -53: return "CL_INVALID_WORK_DIMENSION";
+	case -54: return "CL_INVALID_WORK_GROUP_SIZE";
+	case -55: return "CL_INVALID_WORK_ITEM_SIZE";
+	case -56: return "CL_INVALID_GLOBAL_OFFSET";
+	case -57: return "CL_INVALID_EVENT_WAIT_LIST";
+	case -58: return "CL_INVALID_EVENT";
+	case -59: return "CL_INVALID_OPERATION";
+	case -60: return "CL_INVALID_GL_OBJECT";
+	case -61: return "CL_INVALID_BUFFER_SIZE";
+	case -62: return "CL_INVALID_MIP_LEVEL";
+	case -63: return "CL_INVALID_GLOBAL_WORK_SIZE";
+	case -64: return "CL_INVALID_PROPERTY";
+	case -65: return "CL_INVALID_IMAGE_DESCRIPTOR";
+	case -66: return "CL_INVALID_COMPILER_OPTIONS";
+	case -67: return "CL_INVALID_LINKER_OPTIONS";
+	case -68: return "CL_INVALID_DEVICE_PARTITION_COUNT";
+
+		// extension errors
+	case -1000: return "CL_INVALID_GL_SHAREGROUP_REFERENCE_KHR";
+	case -1001: return "CL_PLATFORM_NOT_FOUND_KHR";
+	case -1002: return "CL_INVALID_D3D10_DEVICE_KHR";
+	case -1003: return "CL_INVALID_D3D10_RESOURCE_KHR";
+	case -1004: return "CL_D3D10_RESOURCE_ALREADY_ACQUIRED_KHR";
+	case -1005: return "CL_D3D10_RESOURCE_NOT_ACQUIRED_KHR";
+	default: return "Unknown OpenCL error";
+	}
+}
+
+void CheckError(cl_int error) {
+	if (error != CL_SUCCESS) {
+		cerr << "OpenCL call failed with error " << getErrorString(error) << endl;
+		exit(1);
+	}
+}
+
+void AddSources(cl::Program::Sources& sources, const string& file_name) {
+	ifstream file(file_name);
+	if (!file)
+		throw cl::Error(CL_INVALID_VALUE, "AddSources: cannot open the kernel source file");
+	sources.push_back(string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()))); //Sources holds the strings themselves
+}
+
+//64-bit FNV-1a hash, used to name cached program binaries
+unsigned long long HashString(const string& text) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < text.size(); i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+void PrintBuildLog(const cl::Program& program, const cl::Device& device) {
+	std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+	std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+	std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+}
+
+//identifier of this process, to keep the temporary files of concurrent runs apart
+unsigned long ProcessId() {
+#ifdef _WIN32
+	return (unsigned long)GetCurrentProcessId();
+#else
+	return (unsigned long)getpid();
+#endif
+}
+
+//replaces target_name with the complete file temp_name in one step, so that readers see either the old or the new file and never a partial one
+//returns false (and removes temp_name) if it can't be moved
+bool MoveFileIntoPlace(const string& temp_name, const string& target_name) {
+#ifdef _WIN32
+	bool moved = MoveFileExA(temp_name.c_str(), target_name.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool moved = rename(temp_name.c_str(), target_name.c_str()) == 0;
+#endif
+	if (!moved)
+		remove(temp_name.c_str());
+	return moved;
+}
+
+//builds the program in file_name for the (single) device of the context
+//if use_cache is set, the device binary is stored next to the source file, keyed by the device name, driver version, build options and source hash,
+//and later builds load it with clCreateProgramWithBinary - a missing, stale, truncated or rejected binary falls back to a build from source
+//the cache is written to a temporary file and moved into place, so that concurrent runs sharing the kernels directory never read a partial file
+cl::Program BuildProgram(const cl::Context& context, const string& file_name, const string& build_options = "", bool use_cache = true, bool* from_cache = NULL) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+	ifstream file(file_name);
+	if (!file)
+		throw cl::Error(CL_INVALID_VALUE, "BuildProgram: cannot open the kernel source file");
+	string source_code((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	stringstream key_stream;
+	key_stream << device.getInfo<CL_DEVICE_NAME>() << "|" << device.getInfo<CL_DRIVER_VERSION>() << "|" << build_options << "|" << HashString(source_code);
+	string key = key_stream.str();
+
+	stringstream cache_name;
+	cache_name << file_name << "." << hex << HashString(key) << ".bin";
+	string cache_file_name = cache_name.str();
+
+	if (from_cache != NULL)
+		*from_cache = false;
+
+	if (use_cache) {
+		//cached file layout: key length, key, binary length, binary - the key is compared in full to rule out hash collisions
+		//the lengths are checked against the size of the file before anything is allocated, so a corrupt file is a miss rather than a bad_alloc
+		ifstream cache_file(cache_file_name, ios::binary | ios::ate);
+		size_t file_size = cache_file ? (size_t)cache_file.tellg() : 0;
+		cache_file.seekg(0);
+		size_t key_length = 0, binary_length = 0;
+		if (cache_file.read((char*)&key_length, sizeof(key_length)) && (key_length == key.size())) {
+			string cached_key(key_length, '\0');
+			cache_file.read(&cached_key[0], key_length);
+			if (cache_file && (cached_key == key) && cache_file.read((char*)&binary_length, sizeof(binary_length))
+				&& (binary_length > 0) && (binary_length == file_size - 2 * sizeof(size_t) - key_length)) {
+				try {
+					cl::Program::Binaries binaries(1, vector<unsigned char>(binary_length));
+					if (cache_file.read((char*)binaries[0].data(), binary_length)) {
+						vector<cl_int> binary_status;
+						cl::Program program(context, { device }, binaries, &binary_status);
+						program.build({ device }, build_options.c_str());
+						if (from_cache != NULL)
+							*from_cache = true;
+						return program;
+					}
+				}
+				catch (const std::exception&) {
+					//the driver rejected the binary (e.g. after an update that kept the version string) or it couldn't be read, build from source instead
+				}
+			}
+		}
+	}
+
+	cl::Program program(context, source_code);
+
+	//build and debug the kernel code
+	try {
+		program.build({ device }, build_options.c_str());
+	}
+	catch (const cl::Error& err) {
+		PrintBuildLog(program, device);
+		throw err;
+	}
+
+	if (use_cache) {
+		vector<vector<unsigned char>> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+		if (!binaries.empty() && !binaries[0].empty()) {
+			stringstream temp_name;
+			temp_name << cache_file_name << "." << ProcessId() << ".tmp";
+			ofstream cache_file(temp_name.str(), ios::binary | ios::trunc);
+			size_t key_length = key.size(), binary_length = binaries[0].size();
+			cache_file.write((const char*)&key_length, sizeof(key_length));
+			cache_file.write(key.data(), key_length);
+			cache_file.write((const char*)&binary_length, sizeof(binary_length));
+			cache_file.write((const char*)binaries[0].data(), binary_length);
+			cache_file.close();
+			if (cache_file)
+				MoveFileIntoPlace(temp_name.str(), cache_file_name); //the cache is only an optimisation, so a failed write is ignored
+			else
+				remove(temp_name.str().c_str());
+		}
+	}
+
+	return program;
+}
+
+string ListPlatformsDevices() {
+
+	stringstream sstream;
+	vector<cl::Platform> platforms;
+
+	cl::Platform::get(&platforms);
+
+	sstream << "Found " << platforms.size() << " platform(s):" << endl;
+
+	for (unsigned int i = 0; i < platforms.size(); i++)
+	{
+		sstream << "\nPlatform " << i << ", " << platforms[i].getInfo<CL_PLATFORM_NAME>() << ", version: " << platforms[i].getInfo<CL_PLATFORM_VERSION>();
+
+		sstream << ", vendor: " << platforms[i].getInfo<CL_PLATFORM_VENDOR>() << endl;
+		//		sstream << ", extensions: " << platforms[i].getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
+
+		vector<cl::Device> devices;
+
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+
+		sstream << "\n   Found " << devices.size() << " device(s):" << endl;
+
+		for (unsigned int j = 0; j < devices.size(); j++)
+		{
+			sstream << "\n      Device " << j << ", " << devices[j].getInfo<CL_DEVICE_NAME>() << ", version: " << devices[j].getInfo<CL_DEVICE_VERSION>();
+
+			sstream << ", vendor: " << devices[j].getInfo<CL_DEVICE_VENDOR>();
+			cl_device_type device_type = devices[j].getInfo<CL_DEVICE_TYPE>();
+			sstream << ", type: ";
+			if (device_type & CL_DEVICE_TYPE_DEFAULT)
+				sstream << "DEFAULT ";
+			if (device_type & CL_DEVICE_TYPE_CPU)
+				sstream << "CPU ";
+			if (device_type & CL_DEVICE_TYPE_GPU)
+				sstream << "GPU ";
+			if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
+				sstream << "ACCELERATOR ";
+			sstream << ", compute units: " << devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			sstream << ", clock freq [MHz]: " << devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+			sstream << ", max memory size [B]: " << devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+			sstream << ", max allocatable memory [B]: " << devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+
+			sstream << endl;
+		}
+	}
+	sstream << "----------------------------------------------------------------" << endl;
+
+	return sstream.str();
+}
+
+cl::Context GetContext(int platform_id, int device_id) {
+	vector<cl::Platform> platforms;
+
+	cl::Platform::get(&platforms);
+
+	for (unsigned int i = 0; i < platforms.size(); i++)
+	{
+		vector<cl::Device> devices;
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+
+		for (unsigned int j = 0; j < devices.size(); j++)
+		{
+			if ((i == platform_id) && (j == device_id))
+				return cl::Context({ devices[j] });
+		}
+	}
+
+	return cl::Context();
+}
+
+//true if platform_id has a device device_id - false as well if there is no OpenCL platform at all
+bool DeviceExists(int platform_id, int device_id) {
+	try {
+		return GetContext(platform_id, device_id)() != NULL;
+	}
+	catch (const cl::Error&) {
+		return false;
+	}
+}
+
+//every device of every platform, in the order ListPlatformsDevices lists them
+vector<cl::Device> GetDevices() {
+	vector<cl::Platform> platforms;
+	vector<cl::Device> all_devices;
+
+	cl::Platform::get(&platforms);
+
+	for (unsigned int i = 0; i < platforms.size(); i++)
+	{
+		vector<cl::Device> devices;
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		all_devices.insert(all_devices.end(), devices.begin(), devices.end());
+	}
+
+	return all_devices;
+}
+
+enum ProfilingResolution {
+	PROF_NS = 1,
+	PROF_US = 1000,
+	PROF_MS = 1000000,
+	PROF_S = 1000000000
+};
+
+string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolution) {
+	stringstream sstream;
+
+	sstream << "Queued " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
+	sstream << ", Submitted " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()) / resolution;
+	sstream << ", Executed " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / resolution;
+	sstream << ", Total " << (evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()) / resolution;
+
+	switch (resolution) {
+	case PROF_NS: sstream << " [ns]"; break;
+	case PROF_US: sstream << " [us]"; break;
+	case PROF_MS: sstream << " [ms]"; break;
+	case PROF_S: sstream << " [s]"; break;
+	default: break;
+	}
+
+	return sstream.str();
+}
+
+//event of one command of a pipeline, together with the name of the stage it is reported under
+//and the bytes of global memory it reads and writes (each buffer counted once, 0 if not known), for the achieved bandwidth
+struct ProfiledEvent {
+	ProfiledEvent(const string& name, const cl::Event& event, size_t bytes = 0) : name(name), event(event), bytes(bytes) {}
+
+	string name;
+	cl::Event event;
+	size_t bytes;
+};
+
+//sum of the execution times of every command of a profile in us
+double DeviceTime(const vector<ProfiledEvent>& profile) {
+	cl_ulong device_time = 0;
+	for (size_t i = 0; i < profile.size(); i++)
+		device_time += profile[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	return device_time / 1000.0;
+}
+
+//per-stage table of the queued, submitted and executed times of every event plus totals - the device time is the sum of the execution times,
+//the device span runs from the first command being queued to the last one finishing, and host_ns (if not negative) is the host wall-clock time
+string GetFullProfilingInfo(const vector<ProfiledEvent>& events, ProfilingResolution resolution, long long host_ns = -1) {
+	stringstream sstream;
+	cl_ulong device_time = 0, first_queued = 0, last_end = 0;
+
+	sstream << left << setw(28) << "Stage" << right << setw(12) << "Queued" << setw(12) << "Submitted" << setw(12) << "Executed" << setw(12) << "Total" << endl;
+	for (size_t i = 0; i < events.size(); i++) {
+		const cl::Event& evnt = events[i].event;
+		cl_ulong queued = evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(), submit = evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		cl_ulong start = evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>(), end = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+		sstream << left << setw(28) << events[i].name << right << setw(12) << (submit - queued) / resolution << setw(12) << (start - submit) / resolution
+			<< setw(12) << (end - start) / resolution << setw(12) << (end - queued) / resolution << endl;
+
+		device_time += end - start;
+		if ((i == 0) || (queued < first_queued))
+			first_queued = queued;
+		if (end > last_end)
+			last_end = end;
+	}
+
+	sstream << "Device time " << device_time / resolution << ", device span " << (last_end - first_queued) / resolution;
+	if (host_ns >= 0)
+		sstream << ", host wall-clock " << host_ns / resolution;
+
+	switch (resolution) {
+	case PROF_NS: sstream << " [ns]"; break;
+	case PROF_US: sstream << " [us]"; break;
+	case PROF_MS: sstream << " [ms]"; break;
+	case PROF_S: sstream << " [s]"; break;
+	default: break;
+	}
+
+	return sstream.str();
+}
+
+//the same profile as GetFullProfilingInfo in machine-readable form (raw device timestamps in ns), as CSV or JSON
+string GetProfilingCSV(const vector<ProfiledEvent>& events, long long host_ns = -1) {
+	stringstream sstream;
+	cl_ulong device_time = 0;
+
+	sstream << "stage,queued_ns,submitted_ns,started_ns,ended_ns,executed_ns" << endl;
+	for (size_t i = 0; i < events.size(); i++) {
+		const cl::Event& evnt = events[i].event;
+		cl_ulong start = evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>(), end = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		sstream << events[i].name << "," << evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>() << "," << evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()
+			<< "," << start << "," << end << "," << end - start << endl;
+		device_time += end - start;
+	}
+	sstream << "device_total,,,,," << device_time << endl;
+	if (host_ns >= 0)
+		sstream << "host_wall_clock,,,,," << host_ns << endl;
+
+	return sstream.str();
+}
+
+string GetProfilingJSON(const vector<ProfiledEvent>& events, long long host_ns = -1) {
+	stringstream sstream;
+	cl_ulong device_time = 0;
+
+	sstream << "{\n  \"stages\": [";
+	for (size_t i = 0; i < events.size(); i++) {
+		const cl::Event& evnt = events[i].event;
+		cl_ulong start = evnt.getProfilingInfo<CL_PROFILING_COMMAND_START>(), end = evnt.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		sstream << (i ? "," : "") << "\n    {\"name\": \"" << events[i].name << "\", \"queued_ns\": " << evnt.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()
+			<< ", \"submitted_ns\": " << evnt.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>() << ", \"started_ns\": " << start << ", \"ended_ns\": " << end
+			<< ", \"executed_ns\": " << end - start << "}";
+		device_time += end - start;
+	}
+	sstream << "\n  ],\n  \"device_total_ns\": " << device_time;
+	if (host_ns >= 0)
+		sstream << ",\n  \"host_wall_clock_ns\": " << host_ns;
+	sstream << "\n}\n";
+
+	return sstream.str();
 }
\ No newline at end of file